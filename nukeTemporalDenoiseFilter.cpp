@@ -15,12 +15,661 @@
 #include "DDImage/Vector2.h"
 #include "DDImage/DDMath.h"
 #include "DDImage/MultiTile.h"
+#include "DDImage/Thread.h"
 #include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <vector>
+#include <map>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <string.h>
+#if defined(__F16C__)
+#include <immintrin.h>
+#include <new>
+#endif
 
 using namespace DD::Image;
 
+//! Number of filter taps between two checks of Op::aborted(). Bounds the time
+//! a cancelled render keeps running regardless of the kernel and search radii.
+static const int kAbortPollTaps = 1 << 15;
+
+//! Kernel radius of the quick spatial-only pass of progressive mode.
+static const int kQuickKernelRadius = 2;
+
+//! Width in pixels of the blocks a row is split into for rejecting neighbour frames.
+static const int kBlockSize = 16;
+
+//! Candidate sources of the temporal search: six neighbour frames, then the
+//! other eye of a stereo pair.
+static const int kMaxCandidates = 7;
+
+//! Search radius around a match handed over by the other eye.
+static const int kRefineRadius = 1;
+
+//! First input of the other view in stereo mode. Inputs kPartnerInputs on
+//! read its frames in the order of inputs 0-6; the first of them is also the
+//! other eye candidate.
+static const int kPartnerInputs = kMaxCandidates;
+
+//! Most memory, in MB, the matches kept for the other eye may hold before
+//! the oldest segments are dropped.
+static const size_t kSharedCacheMB = 256;
+
+//! Width in pixels of the column segments the lead eye's matches are worked
+//! out and shared in. Segments are aligned to column 0, so both eyes cut a
+//! row the same way whatever they request.
+static const int kSharedSegment = 256;
+
+//! Halves per pixel of a shared row: the match offsets into the six
+//! neighbour frames, a mask of the accepted ones and padding.
+static const int kSharedStride = 16;
+
+//! Width in pixels of the spans of rows the time budget is calibrated on.
+static const int kCalibrationWidth = 64;
+
+//! Components of the guide stack reduced by feature mode: position, depth,
+//! albedo, normal and beauty.
+static const int kGuideComponents = 13;
+
+//! Rows of the current frame sampled for the feature bases, and the column step.
+static const int kFeatureSampleRows = 32;
+static const int kFeatureSampleStep = 8;
+
+//! The three feature sets of feature mode, see FeatureBasis: the match test,
+//! the temporal kernel and the spatial kernel.
+static const int kMatchFeatures = 0;
+static const int kTemporalFeatures = 1;
+static const int kSpatialFeatures = 2;
+
+//! Floats per pixel of the features of a neighbour frame: the match
+//! features, their residual and padding, then the temporal features. The
+//! current frame adds its spatial features.
+static const int kFeatureStride = 12;
+static const int kCurrentFeatureStride = 16;
+
+//! Side, in pixels, of the square bricks neighbour frame buffers are stored in.
+static const int kBrickSize = 4;
+
+//! Widest column window, in pixels, the block test scans before it gives up
+//! and keeps the frame.
+static const int kMaxBlockWindow = 256;
+
+//! Largest finite half.
+static const float kHalfMax = 65504.0f;
+
+//! Largest offset from its block origin, in sigmas of the terms that compare
+//! it, a position or depth is kept at in half precision. Half has 11
+//! significant bits, so the rounding error stays below 1/64 of a sigma.
+static const float kHalfSigmaRange = 64.0f;
+
+//! States of a row of the proxy grid.
+static const char kProxyRowEmpty = 0;
+static const char kProxyRowFiltering = 1;
+static const char kProxyRowFilled = 2;
+
+//! Scratch memory currently held by the arenas of all threads, in bytes.
+static std::atomic<size_t> gScratchHeld(0);
+//! Largest value gScratchHeld has reached, in bytes.
+static std::atomic<size_t> gScratchHeldPeak(0);
+
+static void atomicMax ( std::atomic<size_t>& value, size_t candidate )
+{
+	size_t current = value.load();
+	while (candidate > current && !value.compare_exchange_weak(current, candidate)) {}
+}
+
+/*! Scratch memory of one worker thread for the transient buffers of a row:
+	packed guides, block flags and proxy rows. A row claims it with a Scope,
+	which gives all of it back at the end of the row; the memory itself is
+	kept and reused by the next row, so after the first few rows the render
+	path does no heap allocation of its own. Use ScratchArena::local() to get
+	the calling thread's arena.
+ */
+class ScratchArena
+{
+	std::vector< std::vector<double> > _chunks;
+	size_t _used;
+	size_t _chunkUsed;
+	size_t _held;
+	size_t _peak;
+	int _depth;
+
+	void addChunk(size_t bytes)
+	{
+		_chunks.push_back(std::vector<double>((bytes + sizeof(double) - 1) / sizeof(double)));
+		_chunkUsed = 0;
+		_held += _chunks.back().size() * sizeof(double);
+		gScratchHeld += _chunks.back().size() * sizeof(double);
+		atomicMax(gScratchHeldPeak, gScratchHeld.load());
+	}
+
+	//! Releases everything allocated since the last reset(). If the previous
+	//! rows overflowed into several chunks they are merged into one big enough
+	//! for the largest of them and expected bytes.
+	void reset(size_t expected)
+	{
+		const size_t wanted = std::max(expected, _peak);
+		if (_chunks.size() != 1 || _chunks[0].size() * sizeof(double) < wanted) {
+			gScratchHeld -= _held;
+			_held = 0;
+			_chunks.clear();
+			addChunk(wanted);
+		}
+		_used = 0;
+		_chunkUsed = 0;
+		_peak = 0;
+	}
+
+	//! Releases everything allocated since the arena held chunks chunks with
+	//! chunkUsed bytes of the last one and used bytes in all.
+	void rewind(size_t chunks, size_t chunkUsed, size_t used)
+	{
+		while (_chunks.size() > chunks) {
+			_held -= _chunks.back().size() * sizeof(double);
+			gScratchHeld -= _chunks.back().size() * sizeof(double);
+			_chunks.pop_back();
+		}
+		_chunkUsed = chunkUsed;
+		_used = used;
+	}
+
+public:
+	ScratchArena() : _used(0), _chunkUsed(0), _held(0), _peak(0), _depth(0) {}
+	~ScratchArena() { gScratchHeld -= _held; }
+
+	static ScratchArena& local()
+	{
+		static thread_local ScratchArena arena;
+		return arena;
+	}
+
+	/*! Claims the arena for one row. Upstream nodes can run their own rows on
+		the same thread while this row still holds its buffers, from inside a
+		Tile constructor, so only the outermost scope resets the arena; nested
+		scopes allocate after the outer row and release just their own part.
+	 */
+	class Scope
+	{
+		ScratchArena& _arena;
+		size_t _chunks, _chunkUsed, _used, _outerPeak;
+
+	public:
+		Scope(ScratchArena& arena, size_t expected) : _arena(arena)
+		{
+			if (arena._depth++ == 0)
+				arena.reset(expected);
+			_chunks = arena._chunks.size();
+			_chunkUsed = arena._chunkUsed;
+			_used = arena._used;
+			_outerPeak = arena._peak;
+			arena._peak = arena._used;
+		}
+
+		~Scope()
+		{
+			_arena._peak = std::max(_outerPeak, _arena._peak);
+			_arena.rewind(_chunks, _chunkUsed, _used);
+			_arena._depth--;
+		}
+
+		//! Most bytes this scope, including scopes nested in it, has used.
+		size_t peak() const { return _arena._peak - _used; }
+	};
+
+	//! Uninitialized space for n objects of T, aligned to 16 bytes.
+	template <class T> T* allocate(size_t n)
+	{
+		const size_t bytes = (n * sizeof(T) + 15) & ~(size_t)15;
+		if (_chunks.empty() || _chunkUsed + bytes > _chunks.back().size() * sizeof(double))
+			addChunk(std::max(bytes, _held));
+		char* p = reinterpret_cast<char*>(&_chunks.back()[0]) + _chunkUsed;
+		_chunkUsed += bytes;
+		_used += bytes;
+		_peak = std::max(_peak, _used);
+		return reinterpret_cast<T*>(p);
+	}
+};
+
+//! Rounds a float to the nearest half, keeping infinities and NaN.
+static inline unsigned short floatToHalf ( float value )
+{
+#if defined(__F16C__)
+	return _cvtss_sh(value, 0);
+#else
+	unsigned int f;
+	memcpy(&f, &value, 4);
+	const unsigned int sign = f & 0x80000000u;
+	f ^= sign;
+
+	unsigned short h;
+	if (f >= ((127 + 16) << 23)) {
+		h = f > (255u << 23) ? 0x7e00 : 0x7c00;
+	} else if (f < (113u << 23)) {
+		// Zero or subnormal: let the float adder do the rounding.
+		const unsigned int magicBits = ((127 - 15) + (23 - 10) + 1) << 23;
+		float magic, tmp;
+		memcpy(&magic, &magicBits, 4);
+		memcpy(&tmp, &f, 4);
+		tmp += magic;
+		memcpy(&f, &tmp, 4);
+		h = (unsigned short)(f - magicBits);
+	} else {
+		const unsigned int odd = (f >> 13) & 1;
+		f += ((unsigned int)(15 - 127) << 23) + 0xfff + odd;
+		h = (unsigned short)(f >> 13);
+	}
+	return h | (unsigned short)(sign >> 16);
+#endif
+}
+
+//! Widens four halves to floats.
+static inline void halfToFloat4 ( const unsigned short* h, float* out )
+{
+#if defined(__F16C__)
+	_mm_storeu_ps(out, _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)h)));
+#else
+	for (int k = 0; k < 4; k++) {
+		unsigned int o = (unsigned int)(h[k] & 0x7fff) << 13;
+		const unsigned int exponent = o & (0x7c00u << 13);
+		o += (127 - 15) << 23;
+		if (exponent == (0x7c00u << 13)) {
+			o += (128 - 16) << 23;
+		} else if (exponent == 0) {
+			const unsigned int magicBits = 113 << 23;
+			float magic, tmp;
+			o += 1 << 23;
+			memcpy(&magic, &magicBits, 4);
+			memcpy(&tmp, &o, 4);
+			tmp -= magic;
+			memcpy(&o, &tmp, 4);
+		}
+		o |= (unsigned int)(h[k] & 0x8000) << 16;
+		memcpy(&out[k], &o, 4);
+	}
+#endif
+}
+
+//! Packs a normal into two 16 bit octahedral coordinates. Zero normals
+//! (empty pixels) are kept as a reserved code.
+static inline unsigned int encodeNormal ( const float* n )
+{
+	const float l1 = fabs(n[0]) + fabs(n[1]) + fabs(n[2]);
+	if (l1 < 1e-12f)
+		return 0x80008000u;
+	float u = n[0] / l1;
+	float v = n[1] / l1;
+	if (n[2] < 0.0f) {
+		const float fu = (1.0f - fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+		const float fv = (1.0f - fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+		u = fu;
+		v = fv;
+	}
+	const int iu = (int)floor(std::max(-1.0f, std::min(1.0f, u)) * 32767.0f + 0.5f);
+	const int iv = (int)floor(std::max(-1.0f, std::min(1.0f, v)) * 32767.0f + 0.5f);
+	return (unsigned int)(iu & 0xffff) | ((unsigned int)(iv & 0xffff) << 16);
+}
+
+//! Inverse of encodeNormal(), returns a unit normal or zero.
+static inline void decodeNormal ( unsigned int code, float* n )
+{
+	if (code == 0x80008000u) {
+		n[0] = n[1] = n[2] = 0.0f;
+		return;
+	}
+	float u = (short)(code & 0xffff) / 32767.0f;
+	float v = (short)(code >> 16) / 32767.0f;
+	const float w = 1.0f - fabs(u) - fabs(v);
+	if (w < 0.0f) {
+		const float fu = (1.0f - fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+		const float fv = (1.0f - fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+		u = fu;
+		v = fv;
+	}
+	const float length = sqrt(u * u + v * v + w * w);
+	n[0] = u / length;
+	n[1] = v / length;
+	n[2] = w / length;
+}
+
+/*! Offset of the pixel (bx, by) in a buffer stored as kBrickSize square
+	bricks, bricksPerRow bricks wide. The pixels of a brick are contiguous, so
+	a motion vector displaced window touches a few bricks instead of a cache
+	line in every row it spans.
+ */
+static inline size_t brickOffset ( int bx, int by, int bricksPerRow )
+{
+	const unsigned ux = bx, uy = by;
+	return ((size_t)(uy / kBrickSize) * bricksPerRow + ux / kBrickSize) * (kBrickSize * kBrickSize) +
+		   (uy % kBrickSize) * kBrickSize + ux % kBrickSize;
+}
+
+//! Pixels of a bricked buffer of the given size, rounded up to whole bricks.
+static inline size_t brickedPixels ( int width, int height )
+{
+	return (size_t)((width + kBrickSize - 1) / kBrickSize) * ((height + kBrickSize - 1) / kBrickSize) *
+		   (kBrickSize * kBrickSize);
+}
+
+/*! Half precision copy of the guides of one frame over the area of a row's
+	tiles. Each pixel is one 16 byte record: position and depth relative to
+	the origin of its kBlockSize column block, then albedo. Normals, needed
+	for the current frame only, are octahedral 2x16 bit. The search and the
+	kernel read guides from here instead of from six separate float planes.
+
+	Blocks whose offsets do not fit half precision, across a silhouette in
+	front of a far background for instance, keep position and depth as
+	floats instead: exactBlocks holds the index of their record in exact, or
+	-1 for blocks stored as halves.
+ */
+struct GuideBuffer
+{
+	int x, y, r, t;
+	int bricksPerRow;
+	unsigned short* pixels;
+	float* origins;
+	int* exactBlocks;
+	float* exact;
+	unsigned int* normals;
+
+	GuideBuffer() : x(0), y(0), r(0), t(0), bricksPerRow(0), pixels(0), origins(0), exactBlocks(0), exact(0), normals(0) {}
+
+	void setBounds(int bx, int by, int br, int bt)
+	{
+		x = bx;
+		y = by;
+		r = br;
+		t = bt;
+		bricksPerRow = (r - x + kBrickSize - 1) / kBrickSize;
+	}
+
+	//! Pixels the buffer holds, including the padding of its edge bricks.
+	size_t pixelCount() const { return brickedPixels(r - x, t - y); }
+
+	//! Blocks of kBlockSize columns the buffer is split into.
+	int blockCount() const { return (r - x + kBlockSize - 1) / kBlockSize; }
+
+	//! Floats of the record of one block kept in float precision.
+	size_t exactStride() const { return (size_t)(t - y) * kBlockSize * 4; }
+
+	//! Guides of the pixel at (tx, ty), which must lie inside the buffer.
+	//! g receives position, depth and albedo.
+	inline void load(int tx, int ty, float* g) const
+	{
+		const int b = (tx - x) / kBlockSize;
+		const unsigned short* p = &pixels[brickOffset(tx - x, ty - y, bricksPerRow) * 8];
+		halfToFloat4(p + 4, g + 4);
+		if (exactBlocks[b] < 0) {
+			const float* origin = &origins[b * 4];
+			halfToFloat4(p, g);
+			for (int c = 0; c < 4; c++)
+				g[c] += origin[c];
+		} else {
+			const float* e = &exact[exactBlocks[b] * exactStride() + ((ty - y) * kBlockSize + (tx - x) % kBlockSize) * 4];
+			for (int c = 0; c < 4; c++)
+				g[c] = e[c];
+		}
+	}
+
+	inline void loadNormal(int tx, int ty, float* n) const
+	{
+		decodeNormal(normals[brickOffset(tx - x, ty - y, bricksPerRow)], n);
+	}
+};
+
+//! Position and motion vector bounds of one column block of a guide tile over
+//! all its rows: position xyz, then the motion vector.
+struct BlockStats
+{
+	float lo[5], hi[5];
+};
+
+/*! stride floats for each pixel of one tile, in bricks like GuideBuffer:
+	the colour of a neighbour frame, or the features of feature mode. x and
+	y are the origin of the clipped tile.
+ */
+struct BrickBuffer
+{
+	int x, y;
+	int bricksPerRow;
+	int stride;
+	float* data;
+
+	BrickBuffer() : x(0), y(0), bricksPerRow(0), stride(0), data(0) {}
+
+	//! Shapes the buffer to tile and allocates it in arena.
+	void allocate(const Tile& tile, int floats, ScratchArena& arena)
+	{
+		x = tile.x();
+		y = tile.y();
+		bricksPerRow = (tile.r() - tile.x() + kBrickSize - 1) / kBrickSize;
+		stride = floats;
+		data = arena.allocate<float>(brickedPixels(tile.r() - tile.x(), tile.t() - tile.y()) * stride);
+	}
+
+	//! Floats of the pixel (tx, ty), which must lie inside the tile.
+	const float* at(int tx, int ty) const
+	{
+		return &data[brickOffset(tx - x, ty - y, bricksPerRow) * stride];
+	}
+};
+
+/*! The input of one output row: the current frame, up to six neighbour
+	frames and, in stereo mode, the other eye. Each candidate first gets a
+	guide tile with only its motion vectors and position, from which the
+	per-block test decides whether it can contribute at all. Only candidates
+	usable by at least one block of the row get their full tile. For the
+	current frame both are the same tile. Slots are input numbers. Matches
+	are only taken left of sampleR and below sampleT.
+ */
+struct RowFrames
+{
+	Tile* guide[kMaxCandidates + 1];
+	Tile* full[kMaxCandidates + 1];
+	GuideBuffer packed[kMaxCandidates + 1];
+	BlockStats* stats[kMaxCandidates + 1];
+	int statsX[kMaxCandidates + 1], nStats[kMaxCandidates + 1];
+	BrickBuffer colour[kMaxCandidates + 1];
+	BrickBuffer features[kMaxCandidates + 1];
+	int x;
+	int sampleR, sampleT;
+	unsigned char* usable;
+
+	RowFrames() : x(0), sampleR(0), sampleT(0), usable(0)
+	{
+		for (int k = 0; k <= kMaxCandidates; k++) {
+			guide[k] = full[k] = 0;
+			stats[k] = 0;
+			statsX[k] = nStats[k] = 0;
+		}
+	}
+
+	//! The tiles live in the scratch arena of the row, see newTile().
+	~RowFrames()
+	{
+		for (int k = 0; k <= kMaxCandidates; k++) {
+			if (guide[k] && guide[k] != full[k])
+				guide[k]->~Tile();
+			if (full[k])
+				full[k]->~Tile();
+		}
+	}
+
+	//! Flags of the candidates for the block holding pixel i.
+	const unsigned char* blockUsable(int i) const { return &usable[((i - x) / kBlockSize) * kMaxCandidates]; }
+};
+
+/*! Identifies a segment of a row of temporal matches of the lead eye: its
+	view, frame and input hashes, the row, the first column of the segment
+	(the tiles it is searched in are clamped to it) and the search settings.
+ */
+struct SharedRowKey
+{
+	double frame;
+	int view;
+	U64 hash;
+	int y, x;
+	unsigned settings;
+
+	bool operator<(const SharedRowKey& k) const
+	{
+		if (frame != k.frame) return frame < k.frame;
+		if (view != k.view) return view < k.view;
+		if (hash != k.hash) return hash < k.hash;
+		if (y != k.y) return y < k.y;
+		if (x != k.x) return x < k.x;
+		return settings < k.settings;
+	}
+};
+
+/*! Projection of the guide stack onto the leading principal components of
+	the current frame, see featureBases(). Each guide is whitened by scale,
+	centred on mean and projected onto axes; unused components stay zero.
+	retained is the share of the whitened variance the axes keep.
+ */
+struct FeatureBasis
+{
+	int dims;
+	float scale[kGuideComponents];
+	float mean[kGuideComponents];
+	float axes[4][kGuideComponents];
+	float retained;
+};
+
+//! The bases of the three feature sets of one frame.
+struct FeatureBases
+{
+	FeatureBasis set[3];
+};
+
+//! Identifies the feature bases of a frame: its input hash and the whitening.
+struct FeatureKey
+{
+	double frame;
+	U64 hash;
+	unsigned settings;
+
+	bool operator<(const FeatureKey& k) const
+	{
+		if (frame != k.frame) return frame < k.frame;
+		if (hash != k.hash) return hash < k.hash;
+		return settings < k.settings;
+	}
+};
+
+//! Identifies the prepared guides of one row of one input frame, including
+//! the guide channels and half ranges they were packed with.
+struct FrameRowKey
+{
+	double frame;
+	int view;
+	U64 hash;
+	int y, x, r, size;
+	unsigned settings;
+
+	bool operator<(const FrameRowKey& k) const
+	{
+		if (frame != k.frame) return frame < k.frame;
+		if (view != k.view) return view < k.view;
+		if (hash != k.hash) return hash < k.hash;
+		if (y != k.y) return y < k.y;
+		if (x != k.x) return x < k.x;
+		if (r != k.r) return r < k.r;
+		if (size != k.size) return size < k.size;
+		return settings < k.settings;
+	}
+};
+
+/*! Block statistics and packed guides of one row of an input frame, kept for
+	the other output frames of a batch. The guides are empty until a row could
+	use the frame; the normals are only packed for the current frame. x, y, r
+	and t are the bounds of the packed guides, those of the clipped tile.
+ */
+struct FrameRow
+{
+	std::vector<BlockStats> stats;
+	int x, y, r, t;
+	std::vector<unsigned short> pixels;
+	std::vector<float> origins;
+	std::vector<int> exactBlocks;
+	std::vector<float> exact;
+	std::vector<unsigned int> normals;
+
+	FrameRow() : x(0), y(0), r(0), t(0) {}
+
+	//! Memory the row holds, in bytes.
+	size_t bytes() const
+	{
+		return stats.size() * sizeof(BlockStats) + pixels.size() * sizeof(unsigned short) +
+			   (origins.size() + exact.size()) * sizeof(float) + exactBlocks.size() * sizeof(int) +
+			   normals.size() * sizeof(unsigned int);
+	}
+};
+
+//! Folds bytes bytes of data into the FNV-1a hash h.
+static inline unsigned hashBytes ( unsigned h, const void* data, size_t bytes )
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	for (size_t k = 0; k < bytes; k++)
+		h = (h ^ p[k]) * 16777619u;
+	return h;
+}
+
+/*! Packs the matches (x, y, accepted) of the six neighbour frames of pixel
+	(i, y) as half precision offsets from the pixel, which keeps a row of them
+	small enough to hold thousands for the other eye.
+ */
+static inline void packMatches ( const float* matches, int i, int y, unsigned short* out )
+{
+	unsigned short mask = 0;
+	for (int k = 0; k < 6; k++) {
+		out[k * 2] = floatToHalf(matches[k * 3] - i);
+		out[k * 2 + 1] = floatToHalf(matches[k * 3 + 1] - y);
+		if (matches[k * 3 + 2] != 0)
+			mask |= 1 << k;
+	}
+	out[12] = mask;
+	out[13] = out[14] = out[15] = 0;
+}
+
+//! Inverse of packMatches(), with the offsets taken from the point (i, y).
+static inline void unpackMatches ( const unsigned short* packed, float i, float y, float* matches )
+{
+	float offsets[12];
+	halfToFloat4(packed, offsets);
+	halfToFloat4(packed + 4, offsets + 4);
+	halfToFloat4(packed + 8, offsets + 8);
+	for (int k = 0; k < 6; k++) {
+		matches[k * 3] = i + offsets[k * 2];
+		matches[k * 3 + 1] = y + offsets[k * 2 + 1];
+		matches[k * 3 + 2] = (packed[12] >> k) & 1;
+	}
+}
+
+//! Counts filter taps and polls the op for an abort once per kAbortPollTaps.
+struct AbortPoll
+{
+	const Op* op;
+	int taps;
+	long long total;
+
+	AbortPoll(const Op* o) : op(o), taps(0), total(0) {}
+
+	//! Adds cost taps to the count, returns true if the render was aborted.
+	bool operator()(int cost)
+	{
+		taps += cost;
+		total += cost;
+		if (taps < kAbortPollTaps)
+			return false;
+		taps = 0;
+		return op->aborted();
+	}
+};
+
 class GinzburgDenoiseFilterPlugin : public Iop
 {
 	int _size;
@@ -38,6 +687,7 @@ class GinzburgDenoiseFilterPlugin : public Iop
 	bool _albedoDivide;
 	bool _lic;
 	Channel _mv[2];
+	Channel _disparity[2][2];
 	Channel _depth[1];
 	Channel _position[3];
 	Channel _beauty[3];
@@ -45,18 +695,184 @@ class GinzburgDenoiseFilterPlugin : public Iop
 	Channel _albedo[3];
 	Channel _extraChannel[4][3];
 
+	// Proxy preview. The filter runs on a grid of every 2nd/4th pixel of the
+	// bbox, held over the requested area plus one grid step; _proxyX and
+	// _proxyY are its first sample, _proxyW by _proxyH its size. The grid is
+	// shared by all rows and filled lazily by engine().
+	int _previewScale;
+	int _proxyStep;
+	int _proxyX, _proxyY, _proxyW, _proxyH;
+	// Each grid row is kProxyRowEmpty, kProxyRowFiltering while one thread
+	// filters it, then kProxyRowFilled; rows needing it meanwhile wait on
+	// _proxyLock.
+	std::vector<float> _proxyCache;
+	std::vector<char> _proxyRowDone;
+	SignalLock _proxyLock;
+
+	// Progressive mode. _refinePass lives on firstOp() and counts passes: an
+	// even value renders the quick spatial-only pass, odd the full filter.
+	// _refineFrame is the frame the passes are for; moving to another one
+	// starts a new quick pass.
+	// _refineRowBits holds one bit per bbox row from _refineRowY, set for the
+	// rows of the quick pass of _refineGeneration that are done, and
+	// _refineRowsLeft counts the requested ones that are not.
+	bool _progressive;
+	bool _quickPass;
+	unsigned _refinePass;
+	double _refineFrame;
+	bool _refineFrameSeen;
+	unsigned _passGeneration;
+	unsigned _refineGeneration;
+	std::vector<unsigned> _refineRowBits;
+	int _refineRowY;
+	int _refineY, _refineT, _refineRowsLeft;
+	Lock _refineLock;
+
+	// Radii and frame count the current pass actually runs with.
+	int _passSearchRadius, _passKernelRadius, _passFrames;
+
+	// Time budget. The radii and frame count knobs become upper bounds and
+	// _open() lowers them until the predicted time fits _msPerMegapixel. The
+	// time per tap lives on firstOp(), measured by the first _open() of each
+	// budgetMode(), so every frame of a render runs with the same radii.
+	bool _timeBudget;
+	float _msPerMegapixel;
+	double _nsPerTap;
+	unsigned _nsPerTapMode;
+	std::string _budgetReport;
+	Lock _budgetLock;
+
+	// Stereo. The temporal matches of the lead eye are worked out once per
+	// kSharedSegment columns of a row, by whichever eye needs them first, and
+	// published on firstOp(). The lead eye filters with them, the follow eye
+	// starts its search from them through the disparity; both read the same
+	// packed matches, so neither result depends on which eye ran first.
+	// Either eye can use the other's frame as an extra candidate.
+	bool _stereo;
+	bool _otherEye;
+	int _leadView, _followView;
+	unsigned _settingsKey;
+	U64 _sharedHash;
+	std::map<SharedRowKey, std::vector<unsigned short> > _sharedRows;
+	std::deque<SharedRowKey> _sharedOrder;
+	size_t _sharedBytes;
+	Lock _sharedLock;
+
+	// Batch. Every output frame of a batch of _batchFrames consecutive frames
+	// reads the same window of input frames, so the block statistics and packed
+	// guides of each input row are kept on firstOp() until the window moves
+	// on, or the cache outgrows _batchCacheMB and drops its oldest rows. Only
+	// the packing is shared; the tiles are still read per output frame, and
+	// a row is kept per output row it was packed for.
+	int _batchFrames;
+	int _batchCacheMB;
+	unsigned _frameRowSettings;
+	std::map<FrameRowKey, FrameRow> _frameRows;
+	std::deque<FrameRowKey> _frameRowOrder;
+	size_t _frameRowBytes;
+	Lock _batchLock;
+
+	// Feature mode. The match test, the temporal and the spatial kernel each
+	// whiten the guide stack by their own thresholds or sigmas and project it
+	// onto its leading principal components in the current frame; they then
+	// use the distance between these short features. _open() finds the bases
+	// of the current frame and, in the follow eye, the lead eye's; they are
+	// shared on firstOp() per frame, input hash and _featureKey.
+	bool _features;
+	int _featureDims;
+	float _featureScale[3][kGuideComponents];
+	unsigned _featureKey;
+	FeatureBases _frameBases[2];
+	bool _basesReady[2];
+	std::map<FeatureKey, FeatureBases> _featureBases;
+	Lock _featureLock;
+
+	// Largest offset from the block origin packGuides() keeps in half
+	// precision, for position xyz and depth.
+	float _halfRange[4];
+
+	// Scratch bytes one row needs, from the bbox and halo found in _validate.
+	// The most any row of the node used, and the value last reported, live
+	// on firstOp().
+	size_t _scratchBytes;
+	std::atomic<size_t> _scratchPeak, _scratchReported;
+
 public:
 	void _validate(bool);
 	void _request(int x, int y, int r, int t, ChannelMask channels, int count);
+	ChannelSet inputChannels(ChannelMask channels) const;
 	const OutputContext& inputContext(int, int, OutputContext&) const;
 	int maximum_inputs() const { return 1; }
 	int minimum_inputs() const { return 1; }
-	int split_input(int n) const { return 7; }
+	int split_input(int n) const { return _stereo ? kPartnerInputs + 7 : 7; }
+
+	//! Whether the output view is one of the stereo pair; other views are
+	//! filtered on their own.
+	bool stereoView() const
+	{
+		const int view = outputContext().view();
+		return _stereo && _leadView != _followView && (view == _leadView || view == _followView);
+	}
+	bool followView() const { return stereoView() && outputContext().view() == _followView; }
+	int partnerView() const { return outputContext().view() == _leadView ? _followView : _leadView; }
+	//! Disparity from the output view to the other one.
+	const Channel* viewDisparity() const { return _disparity[followView() ? 1 : 0]; }
+	bool otherEyeCandidate() const { return stereoView() && _otherEye && !_quickPass; }
+	//! Whether the rows of this pass share temporal matches between the eyes.
+	bool sharesMatches() const { return stereoView() && !_quickPass && _passFrames > 1 && _proxyStep == 1; }
+	//! The modes that change the time per tap, which is measured again when they do.
+	unsigned budgetMode() const
+	{
+		return 1 | (_features ? 2 : 0) | (otherEyeCandidate() ? 4 : 0) | (stereoView() ? 8 : 0) |
+			   (_previewScale << 4) | (std::max(0, std::min(_featureDims, 15)) << 8);
+	}
 
 	//! Constructor. Initialize user controls to their default values.
-	ExamplePlugin (Node* node) : Iop (node)
+	GinzburgDenoiseFilterPlugin (Node* node) : Iop (node)
 	{
 		_lic = true;
+		_previewScale = 0;
+		_proxyStep = 1;
+		_proxyX = _proxyY = _proxyW = _proxyH = 0;
+		_progressive = false;
+		_quickPass = false;
+		_refinePass = 1;
+		_refineFrame = 0;
+		_refineFrameSeen = false;
+		_passGeneration = 1;
+		_refineGeneration = 0;
+		_refineY = _refineT = _refineRowsLeft = 0;
+		_refineRowY = 0;
+		_stereo = false;
+		_otherEye = false;
+		_leadView = 1;
+		_followView = 2;
+		_settingsKey = 0;
+		_sharedHash = 0;
+		_sharedBytes = 0;
+		_batchFrames = 1;
+		_batchCacheMB = 2048;
+		_frameRowBytes = 0;
+		_frameRowSettings = 0;
+		_features = false;
+		_featureDims = 4;
+		_featureKey = 0;
+		_basesReady[0] = _basesReady[1] = false;
+		for (int f = 0; f < 3; f++)
+			for (int c = 0; c < kGuideComponents; c++)
+				_featureScale[f][c] = 1.0f;
+		for (int c = 0; c < 4; c++)
+			_halfRange[c] = kHalfMax;
+		_passSearchRadius = 3;
+		_passKernelRadius = 5;
+		_timeBudget = false;
+		_msPerMegapixel = 2000.0f;
+		_nsPerTap = 0;
+		_nsPerTapMode = 0;
+		_passFrames = 7;
+		_scratchBytes = 0;
+		_scratchPeak = 0;
+		_scratchReported = 0;
 		_size = 2;
 		_wB = 1;
 		_wAt = 0.01;
@@ -81,18 +897,90 @@ public:
 
 	//! This function does all the work.
 	void engine ( int y, int x, int r, ChannelMask channels, Row& outRow );
+	bool fetchRow ( int y, int x, int r, ChannelMask channels, RowFrames& frames, ScratchArena& arena, int base = 0,
+					bool searchOnly = false );
+	void testBlocks ( int y, int x, int r, RowFrames& frames, ScratchArena& arena );
+	void packGuides ( Tile& positionTile, Tile& tile, int y, bool withNormals, GuideBuffer& buffer, ScratchArena& arena );
+	bool denoisePixel ( const RowFrames& frames, int i, int y, float* result, AbortPoll& poll,
+						const float* hint = 0, const float* given = 0 );
+	bool searchPixel ( const RowFrames& frames, int i, int y, const float* hint,
+					   float (*points)[2], float* maxDist, float* weights, AbortPoll& poll );
+	const unsigned short* sharedMatches ( int y, int x, int r, ChannelMask channels, ScratchArena& arena, AbortPoll& poll );
+	bool searchSegment ( int y, int x, int r, ChannelMask channels, unsigned short* shared, ScratchArena& arena, AbortPoll& poll );
+	void testCandidate ( const RowFrames& frames, int frame, float sampleX, float sampleY,
+						 const float* guide0, const float* beauty0, float* point, float& maxDist, float& weight,
+						 const float* feature0 );
+	bool findSharedRow ( const SharedRowKey& key, int width, unsigned short* matches );
+	void storeSharedRow ( const SharedRowKey& key, int width, const unsigned short* matches );
+	FrameRowKey frameRowKey ( int n, int y, int x, int r ) const;
+	Tile* newTile ( ScratchArena& arena, Iop& input, int y, int x, int r, const ChannelSet& channels );
+	bool loadCachedStats ( const FrameRowKey& key, BlockStats* stats, int nStats );
+	bool loadCachedGuides ( const FrameRowKey& key, bool withNormals, GuideBuffer& buffer, ScratchArena& arena );
+	void storeFrameRow ( const FrameRowKey& key, const BlockStats* stats, int nStats, const GuideBuffer* buffer );
+	void evictFrameRows ( double frame );
+	void evictSharedRows ( double frame );
+	void guideStack ( Tile& positionTile, Tile& tile, int ty, int tx, float* g ) const;
+	ChannelSet featureChannels () const;
+	void requestFeatureRows ( int n, int count );
+	bool featureBases ( FeatureBases& bases, int base );
+	void packFeatures ( Tile& positionTile, Tile& tile, const FeatureBases& bases, bool current, BrickBuffer& buffer, ScratchArena& arena );
+	void packColour ( Tile& tile, BrickBuffer& buffer, ScratchArena& arena );
+	void rowDone ( int y );
+	double tapsPerPixel ( int s, int k, int frames ) const;
+	double calibrateTimeBudget ();
+	bool calibrationSpan ( int s, int& y, int& x, int& r ) const;
+	void requestCalibrationRows ( int count );
+	void fitTimeBudget ( GinzburgDenoiseFilterPlugin* first, double nsPerTap );
+	void preparePass ();
+
+	//! Proxy preview path: filter on the coarse grid, then guided upsampling.
+	bool engineProxy ( int y, int x, int r, ChannelMask channels, Row& outRow );
+	bool fillProxyRow ( int cy, ChannelMask channels );
+	void sizeProxyGrid ( int x, int y, int r, int t );
+
+	void append ( Hash& hash );
+	void _open ();
+	void _close ();
+	int knob_changed ( Knob* k );
 
 	virtual void knobs ( Knob_Callback f )
 	{
 		Float_knob(f, &MotionVectorMult, "MotionVectorMult", "MotionVectorMult");
 		Tooltip(f, "Multiply the uv channels by this");
 		Int_knob(f, &_size, "size", "Filter_size");
+		Enumeration_knob(f, &_previewScale, previewScaleNames, "previewScale", "preview scale");
+		Tooltip(f, "Run the search and filter at 1/2 or 1/4 resolution and upsample the result "
+				"guided by the full resolution normal, depth and albedo. Use full for final renders.");
+		Bool_knob(f, &_progressive, "progressive", "progressive");
+		Tooltip(f, "After a knob or frame change, first show a spatial-only result with a small kernel, "
+				"then refine to the full temporal filter. For interactive use; turn off for final renders.");
 		Int_knob(f, &nFrames, "nFrames", "Frames");
 		Tooltip(f, "Multiply the uv channels by this");
 		Int_knob(f, &kernelRadius, " kernelRadius", "kernelRadius");
 		Tooltip(f, "Multiply the uv channels by this");
 		Int_knob(f, &searchRadius, " searchRadius", "searchRadius");
 		Tooltip(f, "Multiply the uv channels by this");
+		Bool_knob(f, &_features, "features", "reduced features");
+		Tooltip(f, "Compare pixels by a few principal components of the guides instead of each guide on its own. "
+				"Every threshold and sigma keeps its role, but the terms of each test are combined: a match "
+				"must lie within the position, colour and albedo thresholds together, and each kernel weighs "
+				"its terms as one. Faster, slightly less accurate and never matches more than the full guides; "
+				"the variance kept is printed to the terminal.");
+		Int_knob(f, &_featureDims, "featureDims", "feature components");
+		Tooltip(f, "Principal components kept per test in reduced features mode, 3 or 4. "
+				"More keeps more of the guides and matches more pixels.");
+		Int_knob(f, &_batchFrames, "batchFrames", "batch frames");
+		Tooltip(f, "Keep the block statistics and half precision guides packed for each input row, so the other "
+				"output frames of a batch of this many consecutive frames reuse them instead of packing them again. "
+				"Every output frame still reads its own input tiles. Holds the packed guides of batch + 6 frames "
+				"in memory, up to the batch cache size below.");
+		Int_knob(f, &_batchCacheMB, "batchCacheMB", "batch cache MB");
+		Tooltip(f, "Most memory the prepared guides of a batch may hold. The oldest rows are dropped beyond it.");
+		Bool_knob(f, &_timeBudget, "timeBudget", "time budget");
+		Tooltip(f, "Treat Frames, kernelRadius and searchRadius as upper bounds and lower them until the "
+				"filter fits the render time below. The chosen values are printed to the terminal.");
+		Float_knob(f, &_msPerMegapixel, "msPerMegapixel", "ms per megapixel");
+		Tooltip(f, "Target render time of one megapixel of output on this machine, using all threads.");
 
 		Float_knob(f, &_eps, "eps", "treshold");
 		Tooltip(f, "Multiply the uv channels by this");
@@ -145,6 +1033,20 @@ public:
 		Tooltip(f, "The values in these channels are added to the pixel "
 				"coordinate to get the source pixel.");
 
+		Bool_knob(f, &_stereo, "stereo", "stereo");
+		Tooltip(f, "Share the temporal search between the lead and follow views through the disparity channels.");
+		Int_knob(f, &_leadView, "leadView", "lead view");
+		Tooltip(f, "View that runs the full temporal search. The follow view refines its matches.");
+		Int_knob(f, &_followView, "followView", "follow view");
+		Tooltip(f, "View that starts its temporal search from the matches of the lead view.");
+		Input_Channel_knob ( f, _disparity[0], 2, 0, "_disparity[0]", "Disparity channel, lead view");
+		Tooltip(f, "Offset from a pixel of the lead view to the same point in the follow view.");
+		Input_Channel_knob ( f, _disparity[1], 2, 0, "_disparity[1]", "Disparity channel, follow view");
+		Tooltip(f, "Offset from a pixel of the follow view to the same point in the lead view.");
+		Bool_knob(f, &_otherEye, "otherEye", "use other eye");
+		Tooltip(f, "In stereo mode also filter with the other view of the current frame, found through the disparity. "
+				"Adds a candidate frame to every pixel.");
+
 		Input_Channel_knob ( f, _extraChannel[0], 3, 0, "_extraChannel[0]", "Extra channel 0");
 		Tooltip(f, "The values in these channels are added to the pixel "
 				"coordinate to get the source pixel.");
@@ -167,6 +1069,7 @@ private:
 	static const Iop::Description description;
 	static const char* const CLASS;
 	static const char* const HELP;
+	static const char* const previewScaleNames[];
 }; 
 
 /*! This is a function that creates an instance of the operator, and is
@@ -186,18 +1089,239 @@ const Iop::Description GinzburgDenoiseFilterPlugin::description(CLASS, "Ginzburg
 
 const char* const GinzburgDenoiseFilterPlugin::CLASS = "GinzburgDenoiseFilterPlugin";
 const char* const GinzburgDenoiseFilterPlugin::HELP = "GinzburgDenoiseFilterPlugin";
+const char* const GinzburgDenoiseFilterPlugin::previewScaleNames[] = { "full", "1/2", "1/4", 0 };
 
 void GinzburgDenoiseFilterPlugin::_validate(bool for_real)
 {
 	copy_info(0); // copy bbox channels etc from input0, which will validate it.
 	info_.channels();
 	info_.pad( _size);
+
+	GinzburgDenoiseFilterPlugin* first = static_cast<GinzburgDenoiseFilterPlugin*>(firstOp());
+	_passGeneration = first->_refinePass;
+	_quickPass = _progressive && !(_passGeneration & 1);
+	_passKernelRadius = _quickPass ? std::min(kernelRadius, kQuickKernelRadius) : kernelRadius;
+	_passFrames = _quickPass ? 1 : std::max(1, std::min(nFrames, 7));
+	_passSearchRadius = searchRadius;
+
+	// Sized here so rowDone() never allocates; a new bbox starts over.
+	{
+		const size_t rowWords = (info_.t() - info_.y() + 31) / 32;
+		Guard guard(_refineLock);
+		if (_refineRowBits.size() != rowWords || _refineRowY != info_.y()) {
+			_refineRowBits.assign(rowWords, 0u);
+			_refineRowY = info_.y();
+			_refineGeneration = 0;
+		}
+	}
+
+	if (_batchFrames > 1)
+		first->evictFrameRows(outputContext().frame());
+	if (stereoView())
+		first->evictSharedRows(outputContext().frame());
+
+	// Feature mode whitens each guide by the threshold or sigma its term has
+	// in the full test, so a unit distance is where the match test rejects and
+	// the kernels fall to exp(-0.5). Terms a test does not have scale by 0.
+	const float positionWeights[3] = { _epsX, _epsY, _epsZ };
+	const float beautySigma = sqrt(std::max(_wColor * _wB, 0.0f));
+	const float sigmas[3][kGuideComponents - 3] = {
+		{ 0, _wAt, _wAt, _wAt, 0, 0, 0, _epsColor, _epsColor, _epsColor },
+		{ _wDist, _wAt, _wAt, _wAt, 0, 0, 0, _wColor, _wColor, _wColor },
+		{ _wD, _wA, _wA, _wA, _wN, _wN, _wN, beautySigma, beautySigma, beautySigma } };
+	for (int f = 0; f < 3; f++) {
+		for (int c = 0; c < 3; c++)
+			_featureScale[f][c] = f == kMatchFeatures && _eps > 0 ? sqrt(std::max(positionWeights[c], 0.0f)) / _eps : 0.0f;
+		for (int c = 3; c < kGuideComponents; c++)
+			_featureScale[f][c] = sigmas[f][c - 3] > 0 ? 1.0f / sigmas[f][c - 3] : 0.0f;
+	}
+	// The bases are found from the guide channels and whitened by the scales.
+	_featureKey = hashBytes(2166136261u, _featureScale, sizeof(_featureScale));
+	_featureKey = hashBytes(_featureKey, &_featureDims, sizeof(_featureDims));
+	_featureKey = hashBytes(_featureKey, _position, sizeof(_position));
+	_featureKey = hashBytes(_featureKey, _depth, sizeof(_depth));
+	_featureKey = hashBytes(_featureKey, _albedo, sizeof(_albedo));
+	_featureKey = hashBytes(_featureKey, _normal, sizeof(_normal));
+	_featureKey = hashBytes(_featureKey, _beauty, sizeof(_beauty));
+
+	// Positions are compared against _eps through the axis weights, depth
+	// against both depth sigmas.
+	for (int c = 0; c < 3; c++) {
+		const float sigma = positionWeights[c] > 0 ? _eps / sqrt(positionWeights[c]) : kHalfMax;
+		_halfRange[c] = std::min(kHalfMax, std::max(sigma, 0.0f) * kHalfSigmaRange);
+	}
+	_halfRange[3] = std::min(kHalfMax, std::max(std::min(_wD, _wDist), 0.0f) * kHalfSigmaRange);
+
+	// Batch cache rows are only reused with the channels and half ranges
+	// they were prepared with, whether or not a knob change cleared them.
+	_frameRowSettings = hashBytes(2166136261u, _position, sizeof(_position));
+	_frameRowSettings = hashBytes(_frameRowSettings, _mv, sizeof(_mv));
+	_frameRowSettings = hashBytes(_frameRowSettings, _depth, sizeof(_depth));
+	_frameRowSettings = hashBytes(_frameRowSettings, _albedo, sizeof(_albedo));
+	_frameRowSettings = hashBytes(_frameRowSettings, _normal, sizeof(_normal));
+	_frameRowSettings = hashBytes(_frameRowSettings, _halfRange, sizeof(_halfRange));
+
+	preparePass();
+
+	// The proxy grid is sized by _request().
+	_proxyStep = 1 << _previewScale;
+	_proxyX = info_.x();
+	_proxyY = info_.y();
+	_proxyW = _proxyH = 0;
+	_proxyCache.clear();
+	_proxyRowDone.clear();
+}
+
+/*! Sizes the proxy grid to the samples the rows y..t, columns x..r, blend:
+	those from the one at or left of / below each pixel to the next one. The
+	grid stays aligned to the bbox, so the samples do not depend on the
+	request. Filled rows are kept while the grid does not move.
+ */
+void GinzburgDenoiseFilterPlugin::sizeProxyGrid ( int x, int y, int r, int t )
+{
+	const int step = _proxyStep;
+	const int x0 = std::max(info_.x(), std::min(x, info_.r() - 1));
+	const int x1 = std::max(info_.x(), std::min(r - 1, info_.r() - 1));
+	const int y0 = std::max(info_.y(), std::min(y, info_.t() - 1));
+	const int y1 = std::max(info_.y(), std::min(t - 1, info_.t() - 1));
+	const int proxyX = info_.x() + (x0 - info_.x()) / step * step;
+	const int proxyY = info_.y() + (y0 - info_.y()) / step * step;
+	const int proxyW = (x1 - proxyX) / step + 2;
+	const int proxyH = (y1 - proxyY) / step + 2;
+
+	Guard guard(_proxyLock);
+	if (proxyX == _proxyX && proxyY == _proxyY && proxyW == _proxyW && proxyH == _proxyH)
+		return;
+	_proxyX = proxyX;
+	_proxyY = proxyY;
+	_proxyW = proxyW;
+	_proxyH = proxyH;
+	_proxyCache.assign((size_t)_proxyW * _proxyH * 15, 0.0f);
+	_proxyRowDone.assign(_proxyH, kProxyRowEmpty);
+}
+
+/*! Derives what depends on the radii and frame count of the pass: the
+	scratch bytes of a row and the keys of the matches shared between eyes.
+ */
+void GinzburgDenoiseFilterPlugin::preparePass()
+{
+	// Packed guides of every frame of the pass, and of a segment of the lead
+	// eye's frames for the shared matches, their tiles, block flags, the
+	// shared matches and a proxy row.
+	const size_t tileWidth = info_.r() - info_.x() + 2 * _size;
+	const size_t tilePixels = brickedPixels(tileWidth, std::max(1, 2 * _size));
+	const size_t nBlocks = (tileWidth + kBlockSize - 1) / kBlockSize;
+	const int nCandidateFrames = _passFrames + (otherEyeCandidate() ? 1 : 0);
+	const size_t segmentPixels = brickedPixels(kSharedSegment + 2 * _size, std::max(1, 2 * _size));
+	const size_t segmentBlocks = (kSharedSegment + 2 * _size + kBlockSize - 1) / kBlockSize;
+	_scratchBytes = nCandidateFrames * (tilePixels * 8 * sizeof(unsigned short) + nBlocks * (4 * sizeof(float) + sizeof(int)) + 48) +
+					(sharesMatches() ? _passFrames * (segmentPixels * 8 * sizeof(unsigned short) +
+									   segmentBlocks * (4 * sizeof(float) + sizeof(int) + sizeof(BlockStats)) + 64) +
+									   (kMaxCandidates + 1) * (2 * sizeof(Tile) + 32) : 0) +
+					(nCandidateFrames - 1) * (tilePixels * 16 * sizeof(float) + 16) +
+					(kMaxCandidates + 1) * (nBlocks * sizeof(BlockStats) + 2 * sizeof(Tile) + 48) +
+					(_features ? (kMaxCandidates + 1) * (tilePixels * kFeatureStride * sizeof(float) + 16) +
+								 tilePixels * (kCurrentFeatureStride - kFeatureStride) * sizeof(float) : 0) +
+					tilePixels * sizeof(unsigned int) + nBlocks * kMaxCandidates + 16 +
+					tileWidth * kSharedStride * sizeof(unsigned short) * 2 + 32 +
+					(tileWidth + 2) * 15 * sizeof(float) + 16;
+
+	// Matches are only shared between eyes filtered with the same settings,
+	// including the sigmas feature mode whitens by, the guide channels and
+	// the half ranges the guides are packed with, and the same lead eye
+	// frames: inputs 0-6 of the lead view, those from kPartnerInputs on of
+	// the follow view.
+	const float settings[] = { (float)_passSearchRadius, (float)_passFrames, (float)_size, _eps, _epsColor, _wAt,
+							   _epsX, _epsY, _epsZ, MotionVectorMult, (float)useMV, (float)_features,
+							   (float)_featureDims, _wD, _wA, _wN, _wColor, _wB };
+	_settingsKey = hashBytes(2166136261u, settings, sizeof(settings));
+	_settingsKey = hashBytes(_settingsKey, _position, sizeof(_position));
+	_settingsKey = hashBytes(_settingsKey, _mv, sizeof(_mv));
+	_settingsKey = hashBytes(_settingsKey, _depth, sizeof(_depth));
+	_settingsKey = hashBytes(_settingsKey, _albedo, sizeof(_albedo));
+	_settingsKey = hashBytes(_settingsKey, _normal, sizeof(_normal));
+	_settingsKey = hashBytes(_settingsKey, _beauty, sizeof(_beauty));
+	_settingsKey = hashBytes(_settingsKey, _disparity, sizeof(_disparity));
+	_settingsKey = hashBytes(_settingsKey, _halfRange, sizeof(_halfRange));
+	_sharedHash = 0;
+	if (stereoView()) {
+		const int leadBase = followView() ? kPartnerInputs : 0;
+		_sharedHash = 14695981039346656037ull;
+		for (int k = 0; k < 7; k++)
+			_sharedHash = (_sharedHash ^ input(leadBase + k)->hash().value()) * 1099511628211ull;
+	}
+}
+
+/*! Reports the scratch arena high-water marks, for sizing farm memory limits:
+	the most one row of this node needed and the most held by all threads of
+	the process. Only reported when the node's mark has grown since the last
+	report, so closing the ops of each frame does not repeat it.
+ */
+void GinzburgDenoiseFilterPlugin::_close()
+{
+	GinzburgDenoiseFilterPlugin* first = static_cast<GinzburgDenoiseFilterPlugin*>(firstOp());
+	const size_t peak = first->_scratchPeak.load();
+	if (peak == 0 || first->_scratchReported.exchange(peak) == peak)
+		return;
+	std::cerr << "GinzburgDenoiseFilter: scratch high-water " << peak / 1024 << " KB per row, "
+			  << gScratchHeldPeak.load() / 1024 << " KB over all threads" << std::endl;
+}
+
+/*! In progressive mode the hash carries the pass, and a frame other than
+	the last one hashed, or the first one, starts a new quick pass, so
+	scrubbing shows the quick result of each frame first.
+ */
+void GinzburgDenoiseFilterPlugin::append(Hash& hash)
+{
+	GinzburgDenoiseFilterPlugin* first = static_cast<GinzburgDenoiseFilterPlugin*>(firstOp());
+	if (_progressive) {
+		Guard guard(first->_refineLock);
+		const double frame = outputContext().frame();
+		if (!first->_refineFrameSeen || first->_refineFrame != frame) {
+			first->_refinePass = (first->_refinePass | 1) + 1;
+			first->_refineFrame = frame;
+			first->_refineFrameSeen = true;
+		}
+		hash.append(first->_refinePass);
+	}
+}
+
+/*! Any knob change restarts progressive mode at a new quick pass. Every pass
+	gets a new hash, so a stale full pass is never picked up from the cache.
+	It also drops the matches shared between the eyes, the batch cache and
+	the feature bases.
+ */
+int GinzburgDenoiseFilterPlugin::knob_changed(Knob* k)
+{
+	{
+		Guard guard(_sharedLock);
+		_sharedRows.clear();
+		_sharedOrder.clear();
+		_sharedBytes = 0;
+	}
+	{
+		Guard guard(_batchLock);
+		_frameRows.clear();
+		_frameRowOrder.clear();
+		_frameRowBytes = 0;
+	}
+	{
+		Guard guard(_featureLock);
+		_featureBases.clear();
+	}
+	// Always 1, so Nuke keeps calling this for the panel even while
+	// progressive mode is off.
+	if (_progressive) {
+		Guard guard(_refineLock);
+		_refinePass = (_refinePass | 1) + 1;
+	}
+	return 1;
 }
 
 const OutputContext& GinzburgDenoiseFilterPlugin::inputContext(int i, int n, OutputContext& context) const
 {
 	context = outputContext();
-	switch (n) {
+	switch (n % kPartnerInputs) {
 		case 0:
 			break;
 		case 1:
@@ -219,13 +1343,16 @@ const OutputContext& GinzburgDenoiseFilterPlugin::inputContext(int i, int n, Out
 			context.setFrame(context.frame() - 3);
 			break;
 	}
+	if (n >= kPartnerInputs)
+		context.setView(partnerView());
 	return context;
 }
 
-void GinzburgDenoiseFilterPlugin::_request(int x, int y, int r, int t, ChannelMask channels, int count)
+/*! The channels every pass of the filter reads from the inputs: the requested
+	channels plus all guide, beauty and extra channels selected on the knobs.
+ */
+ChannelSet GinzburgDenoiseFilterPlugin::inputChannels(ChannelMask channels) const
 {
-	// for this example, we're only interested in the RGB channels
-	//input(0)->request( x, y, r, t, channels, count );
 	ChannelSet c1(channels);
 	c1 += (_mv[0]);
 	c1 += (_mv[1]);
@@ -254,9 +1381,49 @@ void GinzburgDenoiseFilterPlugin::_request(int x, int y, int r, int t, ChannelMa
 	c1 += (_extraChannel[3][0]);
 	c1 += (_extraChannel[3][1]);
 	c1 += (_extraChannel[3][2]);
+	if (stereoView()) {
+		c1 += (viewDisparity()[0]);
+		c1 += (viewDisparity()[1]);
+	}
+	return c1;
+}
+
+void GinzburgDenoiseFilterPlugin::_request(int x, int y, int r, int t, ChannelMask channels, int count)
+{
+	// for this example, we're only interested in the RGB channels
+	//input(0)->request( x, y, r, t, channels, count );
+	ChannelSet c1 = inputChannels(channels);
 
 	xMax = r;
 	yMax = t;
+
+	if (_quickPass) {
+		// Rows already done by this pass stay done; the row cache will not
+		// run engine() on them again.
+		Guard guard(_refineLock);
+		if (_refineGeneration != _passGeneration) {
+			_refineGeneration = _passGeneration;
+			std::fill(_refineRowBits.begin(), _refineRowBits.end(), 0u);
+		}
+		_refineY = std::max(y, _refineRowY);
+		_refineT = std::min(t, _refineRowY + (int)_refineRowBits.size() * 32);
+		_refineRowsLeft = 0;
+		for (int row = _refineY; row < _refineT; row++) {
+			const int bit = row - _refineRowY;
+			if (!(_refineRowBits[bit / 32] & (1u << (bit % 32))))
+				_refineRowsLeft++;
+		}
+	}
+
+	// The proxy grid is filled over the requested columns, one grid step
+	// around them.
+	if (_proxyStep > 1) {
+		sizeProxyGrid(x, y, r, t);
+		x -= _proxyStep;
+		r += _proxyStep;
+		y -= _proxyStep;
+		t += _proxyStep;
+	}
 	input(0) -> request(x- _size,y- _size,r+ _size,t+  _size,c1,count * 2);
 	input(1) -> request(x- _size,y- _size,r+ _size,t+  _size,c1,count * 2);
 	input(2) -> request(x- _size,y- _size,r+ _size,t+  _size,c1,count * 2);
@@ -264,6 +1431,26 @@ void GinzburgDenoiseFilterPlugin::_request(int x, int y, int r, int t, ChannelMa
 	input(4) -> request(x- _size,y- _size,r+ _size,t+  _size,c1,count * 2);
 	input(5) -> request(x- _size,y- _size,r+ _size,t+  _size,c1,count * 2);
 	input(6) -> request(x- _size,y- _size,r+ _size,t+  _size,c1,count * 2);
+	if (otherEyeCandidate())
+		input(kPartnerInputs) -> request(x- _size,y- _size,r+ _size,t+  _size,c1,count * 2);
+	// Either eye reads the lead eye's frames over whole segments when their
+	// matches are not there yet.
+	const bool leadFrames = followView() && sharesMatches();
+	if (sharesMatches()) {
+		const int leadBase = leadFrames ? kPartnerInputs : 0;
+		const int sx = (int)floor((double)x / kSharedSegment) * kSharedSegment;
+		const int sr = (int)ceil((double)r / kSharedSegment) * kSharedSegment;
+		for (int k = 0; k < 7; k++)
+			input(leadBase + k) -> request(sx- _size,y- _size,sr+ _size,t+  _size,c1,count * 2);
+	}
+	if (_timeBudget && !_quickPass)
+		requestCalibrationRows(count);
+	// _open() samples the current frame, and the lead eye's, for the feature bases.
+	if (_features) {
+		requestFeatureRows(0, count);
+		if (leadFrames)
+			requestFeatureRows(kPartnerInputs, count);
+	}
 }
 
 /*! For each line in the area passed to request(), this will be called. It must
@@ -274,624 +1461,1686 @@ void GinzburgDenoiseFilterPlugin::_request(int x, int y, int r, int t, ChannelMa
  */
 void GinzburgDenoiseFilterPlugin::engine ( int y, int x, int r, ChannelMask channels, Row& outRow )
 {
+	if (_proxyStep > 1) {
+		if (engineProxy(y, x, r, channels, outRow))
+			rowDone(y);
+		return;
+	}
+
 	ChannelMask rgbMask(Mask_RGB);
-	ChannelSet c1(channels);
-	c1 += (_mv[0]);
-	c1 += (_mv[1]);
-	c1 += (_mv[2]);
-	c1 += (_beauty[0]);
-	c1 += (_beauty[1]);
-	c1 += (_beauty[2]);
-	c1 += (_position[0]);
-	c1 += (_position[1]);
-	c1 += (_position[2]);
-	c1 += (_depth[0]);
-	c1 += (_normal[0]);
-	c1 += (_normal[1]);
-	c1 += (_normal[2]);
-	c1 += (_albedo[0]);
-	c1 += (_albedo[1]);
-	c1 += (_albedo[2]);
-	c1 += (_extraChannel[0][0]);
-	c1 += (_extraChannel[0][1]);
-	c1 += (_extraChannel[0][2]);
-	c1 += (_extraChannel[1][0]);
-	c1 += (_extraChannel[1][1]);
-	c1 += (_extraChannel[1][2]);
-	c1 += (_extraChannel[2][0]);
-	c1 += (_extraChannel[2][1]);
-	c1 += (_extraChannel[2][2]);
-	c1 += (_extraChannel[3][0]);
-	c1 += (_extraChannel[3][1]);
-	c1 += (_extraChannel[3][2]);
+	ChannelSet c1 = inputChannels(channels);
 
-	Tile tile(  input0(), x - _size, y - _size, r + _size, y + _size, c1);
-	Tile tile1( input1(), x - _size , y - _size , r + _size, y + _size , c1);
-	Tile tile2( *input(2), x - _size, y - _size, r + _size, y +  _size, c1);
-	Tile tile3( *input(3), x - _size, y - _size, r + _size, y +  _size, c1);
-	Tile tile4( *input(4), x - _size, y - _size, r + _size, y + _size, c1);
-	Tile tile5( *input(5), x - _size, y - _size, r + _size, y +  _size, c1);
-	Tile tile6( *input(6), x - _size, y - _size, r + _size, y +  _size, c1);
+	ScratchArena& arena = ScratchArena::local();
+	ScratchArena::Scope scope(arena, _scratchBytes);
+	RowFrames frames;
+	bool fetched = fetchRow(y, x, r, channels, frames, arena);
 
 	foreach(z, c1) outRow.writable(z);
-	if ( aborted() ) {
+	if ( !fetched ) {
 		std::cerr << "Aborted!";
 		return;
 	}
-	float pDist[6];
-	float pColor[6];
-	float pZt[6];
-	float pZtA[6];
-	float pPos;
-	float pChannel[6][15];
-	float mvTrace[6][2];
-	float temporalPointsXY[6][2];
-	float maxDist[6];
-	float sumWeightXY[6];
-	float colorValue = 0;
-	float spatTemporalWeight = 0;
-	float depthValue = 0;
 
-	float albedoValue0[] = {0.0f,0.0f,0.0f};
-	float albedoValue1[] = {0.0f,0.0f,0.0f};
+	float* out[15];
+	for (int c = 0; c < 3; c++) {
+		out[c] = outRow.writable(_beauty[c]);
+		for (int e = 0; e < 4; e++)
+			out[3 + e * 3 + c] = outRow.writable(_extraChannel[e][c]);
+	}
 
-	float beautyValue0[] = {0.0f,0.0f,0.0f};
-	float beautyValue1[] = {0.0f,0.0f,0.0f};
+	// In stereo mode the lead eye filters with the published matches of the
+	// row and the follow eye seeds its search with them through the
+	// disparity. The matches are packed whichever eye worked them out, so
+	// neither result depends on that.
+	GinzburgDenoiseFilterPlugin* first = (GinzburgDenoiseFilterPlugin*)firstOp();
+	const bool share = sharesMatches();
+	const bool follow = share && followView();
+	AbortPoll poll(this);
+	Tile& tile = *frames.full[0];
+	const int cy = tile.clampy(y);
+	const Channel* disparity = viewDisparity();
+
+	// The follow eye needs the lead eye's columns its disparity points at,
+	// within the lead eye's bbox.
+	int leadX = x, leadR = r;
+	if (follow) {
+		const Info& leadInfo = input(kPartnerInputs)->info();
+		leadX = leadInfo.r() + _size;
+		leadR = leadInfo.x() - _size;
+		for (int i = x; i < r; i++) {
+			if (fabs(tile[disparity[1]][cy][tile.clampx(i)]) >= 0.5f)
+				continue;
+			const int xp = (int)floor(i + tile[disparity[0]][cy][tile.clampx(i)] + 0.5f);
+			leadX = std::min(leadX, xp);
+			leadR = std::max(leadR, xp + 1);
+		}
+		leadX = std::max(leadX, leadInfo.x() - _size);
+		leadR = std::min(leadR, leadInfo.r() + _size);
+	}
+	const unsigned short* lead = 0;
+	if (share && leadX < leadR && !(lead = sharedMatches(y, leadX, leadR, channels, arena, poll))) {
+		std::cerr << "Aborted!";
+		return;
+	}
 
-	float normalValue0[] = {0.0f,0.0f,0.0f};
-	float normalValue1[] = {0.0f,0.0f,0.0f};
+	for(int i = x; i < r; i++){
+		float result[15];
+		float hint[18];
+		const float* pixelHint = 0;
+		const float* given = 0;
+		if (lead && follow) {
+			const float dx = tile[disparity[0]][cy][tile.clampx(i)];
+			const float dy = tile[disparity[1]][cy][tile.clampx(i)];
+			const int xp = (int)floor(i + dx + 0.5f);
+			if (fabs(dy) < 0.5f && xp >= leadX && xp < leadR) {
+				unpackMatches(&lead[(xp - leadX) * kSharedStride], xp - dx, y - dy, hint);
+				pixelHint = hint;
+			}
+		} else if (lead) {
+			unpackMatches(&lead[(i - x) * kSharedStride], i, y, hint);
+			given = hint;
+		}
+		if (!denoisePixel(frames, i, y, result, poll, pixelHint, given)) {
+			std::cerr << "Aborted!";
+			return;
+		}
+		for (int c = 0; c < 15; c++)
+			out[c][i] = result[c];
+	}
+	atomicMax(first->_scratchPeak, scope.peak());
+	rowDone(y);
+}
 
-	float currWeightSpat = 0;
-	float sumWeightSpat = 0;
-	float beautyDist = 0;
-	float albedoDist = 0;
-	float depthDist = 0;
-	float normalDist = 0;
-	float positionDist = 0;
+//! Search and kernel taps per output pixel for search radius s, kernel radius k
+//! and the given number of frames, as counted by AbortPoll in denoisePixel().
+double GinzburgDenoiseFilterPlugin::tapsPerPixel ( int s, int k, int frames ) const
+{
+	const int nCandidates = frames - 1 + (stereoView() && _otherEye ? 1 : 0);
+	return (double)(2*s+1)*(2*s+1)*nCandidates + (double)(2*k+1)*(2*k+1)*(nCandidates+1);
+}
+
+/*! Span s, 1 to 3, the time budget is calibrated on: kCalibrationWidth
+	pixels in the middle of the row at s quarters of the bbox. Returns false
+	if the bbox is empty.
+ */
+bool GinzburgDenoiseFilterPlugin::calibrationSpan ( int s, int& y, int& x, int& r ) const
+{
+	const int width = std::min(kCalibrationWidth, info_.r() - info_.x());
+	const int height = info_.t() - info_.y();
+	if (width <= 0 || height <= 0)
+		return false;
+	x = info_.x() + (info_.r() - info_.x() - width) / 2;
+	r = x + width;
+	y = info_.y() + height * s / 4;
+	return true;
+}
 
-	float*  outr = outRow.writable(_beauty[0]);
-	float*  outg = outRow.writable(_beauty[1]);
-	float*  outb = outRow.writable(_beauty[2]);
+//! Requests the tiles fetchRow() reads for the calibration spans.
+void GinzburgDenoiseFilterPlugin::requestCalibrationRows ( int count )
+{
+	const ChannelSet c1 = inputChannels(Mask_RGB);
+	for (int s = 1; s <= 3; s++) {
+		int y, x, r;
+		if (!calibrationSpan(s, y, x, r))
+			return;
+		for (int k = 0; k < std::max(1, std::min(nFrames, 7)); k++)
+			input(k) -> request(x- _size,y- _size,r+ _size,y+  _size,c1,count);
+		if (otherEyeCandidate())
+			input(kPartnerInputs) -> request(x- _size,y- _size,r+ _size,y+  _size,c1,count);
+	}
+}
+
+/*! Measures the time per filter tap on this thread. The calibrationSpan()s
+	are filtered with the radii and frame count of the knobs. Only the search
+	and kernel loops are timed, not the fetching of their tiles. Returns 0 if
+	aborted.
+ */
+double GinzburgDenoiseFilterPlugin::calibrateTimeBudget ()
+{
+	ScratchArena& arena = ScratchArena::local();
+	long long taps = 0;
+	double nanos = 0;
+	for (int s = 1; s <= 3; s++) {
+		int y, x, r;
+		if (!calibrationSpan(s, y, x, r))
+			return 0;
+		ScratchArena::Scope scope(arena, _scratchBytes);
+		RowFrames frames;
+		if (!fetchRow(y, x, r, ChannelSet(Mask_RGB), frames, arena))
+			return 0;
+
+		AbortPoll poll(this);
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int i = x; i < r; i++) {
+			float result[15];
+			if (!denoisePixel(frames, i, y, result, poll))
+				return 0;
+		}
+		nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		taps += poll.total;
+	}
+	return taps > 0 ? std::max(nanos / taps, 0.01) : 0;
+}
+
+/*! Lowers the search radius, frame count and kernel radius of the knobs until
+	the predicted time per megapixel fits the budget. The search radius goes
+	first as it only refines the motion vectors, then whole frames, then the
+	kernel. Reports the choice whenever it changes.
+ */
+void GinzburgDenoiseFilterPlugin::fitTimeBudget ( GinzburgDenoiseFilterPlugin* first, double nsPerTap )
+{
+	// One ms per megapixel is one ns per pixel of wall time. Rows run on all
+	// of Nuke's worker threads, and proxy mode filters one pixel per step x
+	// step block.
+	const double threads = std::max(1u, Thread::numThreads);
+	const double step = 1 << _previewScale;
+	const double budget = _msPerMegapixel * threads * step * step / nsPerTap;
+
+	int s = searchRadius, k = kernelRadius, n = std::max(1, std::min(nFrames, 7));
+	while (tapsPerPixel(s, k, n) > budget) {
+		if (s > 1) s--;
+		else if (n > 1) n--;
+		else if (k > 1) k--;
+		else if (s > 0) s--;
+		else if (k > 0) k--;
+		else break;
+	}
+	_passSearchRadius = s;
+	_passKernelRadius = k;
+	_passFrames = n;
+
+	std::ostringstream report;
+	report << "GinzburgDenoiseFilter: " << _msPerMegapixel << " ms per megapixel gives searchRadius " << s
+		   << ", kernelRadius " << k << ", nFrames " << n << " (" << nsPerTap << " ns per tap)";
+	Guard guard(first->_budgetLock);
+	if (report.str() != first->_budgetReport) {
+		first->_budgetReport = report.str();
+		std::cerr << first->_budgetReport << std::endl;
+	}
+}
 
-	float*  outE0r = outRow.writable(_extraChannel[0][0]);
-	float*  outE0g = outRow.writable(_extraChannel[0][1]);
-	float*  outE0b = outRow.writable(_extraChannel[0][2]);
+/*! Finds the feature bases and fits the pass to the time budget before any
+	row is filtered. The first op of the node to open measures the time per
+	tap; later ones, including every other frame of the render, reuse it
+	until one opens in another budgetMode().
+ */
+void GinzburgDenoiseFilterPlugin::_open()
+{
+	_basesReady[0] = _features && featureBases(_frameBases[0], 0);
+	_basesReady[1] = _features && followView() && sharesMatches() && featureBases(_frameBases[1], kPartnerInputs);
+	if (!_timeBudget || _quickPass)
+		return;
+	GinzburgDenoiseFilterPlugin* first = static_cast<GinzburgDenoiseFilterPlugin*>(firstOp());
+	double nsPerTap;
+	{
+		Guard guard(first->_budgetLock);
+		if (first->_nsPerTap <= 0 || first->_nsPerTapMode != budgetMode()) {
+			first->_nsPerTap = calibrateTimeBudget();
+			first->_nsPerTapMode = budgetMode();
+		}
+		nsPerTap = first->_nsPerTap;
+	}
+	if (nsPerTap <= 0)
+		return;
+	fitTimeBudget(first, nsPerTap);
+	preparePass();
+}
 
-	float*  outE1r = outRow.writable(_extraChannel[1][0]);
-	float*  outE1g = outRow.writable(_extraChannel[1][1]);
-	float*  outE1b = outRow.writable(_extraChannel[1][2]);
+/*! Copies the shared matches stored under key, width columns of them,
+	into matches. Returns false if that segment has not been worked out yet.
+ */
+bool GinzburgDenoiseFilterPlugin::findSharedRow ( const SharedRowKey& key, int width, unsigned short* matches )
+{
+	Guard guard(_sharedLock);
+	std::map<SharedRowKey, std::vector<unsigned short> >::const_iterator it = _sharedRows.find(key);
+	if (it == _sharedRows.end() || it->second.size() != (size_t)width * kSharedStride)
+		return false;
+	std::copy(it->second.begin(), it->second.end(), matches);
+	return true;
+}
 
-	float*  outE2r = outRow.writable(_extraChannel[2][0]);
-	float*  outE2g = outRow.writable(_extraChannel[2][1]);
-	float*  outE2b = outRow.writable(_extraChannel[2][2]);
+//! Publishes the packed matches of the width columns of the segment key.x,
+//! unless they already are, dropping the oldest segments beyond kSharedCacheMB.
+void GinzburgDenoiseFilterPlugin::storeSharedRow ( const SharedRowKey& key, int width, const unsigned short* matches )
+{
+	Guard guard(_sharedLock);
+	std::vector<unsigned short>& row = _sharedRows[key];
+	if (!row.empty())
+		return;
+	_sharedOrder.push_back(key);
+	row.assign(matches, matches + (size_t)width * kSharedStride);
+	_sharedBytes += row.size() * sizeof(unsigned short);
+	while (_sharedBytes > (kSharedCacheMB << 20) && !_sharedOrder.empty()) {
+		std::map<SharedRowKey, std::vector<unsigned short> >::iterator oldest = _sharedRows.find(_sharedOrder.front());
+		_sharedOrder.pop_front();
+		if (oldest == _sharedRows.end())
+			continue;
+		_sharedBytes -= oldest->second.size() * sizeof(unsigned short);
+		_sharedRows.erase(oldest);
+	}
+}
 
-	float*  outE3r = outRow.writable(_extraChannel[3][0]);
-	float*  outE3g = outRow.writable(_extraChannel[3][1]);
-	float*  outE3b = outRow.writable(_extraChannel[3][2]);
+/*! Drops the shared matches of frames the eyes have moved on from: all but
+	those within a batch of frame, which may still be in flight.
+ */
+void GinzburgDenoiseFilterPlugin::evictSharedRows ( double frame )
+{
+	const double reach = std::max(_batchFrames, 1) - 1;
+	Guard guard(_sharedLock);
+	for (std::map<SharedRowKey, std::vector<unsigned short> >::iterator it = _sharedRows.begin(); it != _sharedRows.end(); ) {
+		if (fabs(it->first.frame - frame) > reach) {
+			_sharedBytes -= it->second.size() * sizeof(unsigned short);
+			_sharedRows.erase(it++);
+		} else {
+			++it;
+		}
+	}
+	std::deque<SharedRowKey> order;
+	for (std::deque<SharedRowKey>::const_iterator it = _sharedOrder.begin(); it != _sharedOrder.end(); ++it)
+		if (_sharedRows.count(*it))
+			order.push_back(*it);
+	_sharedOrder.swap(order);
+}
 
-	for(int i = x; i < r; i++){
-		float resultValue[3];
-		float resultValueE[4][3];
-		float currentWeight = 0;
-		float sumWeight = 1;
-		float sumWeightSpat = 1;
+/*! Packed matches of the lead eye for row y, columns x..r, taken from the
+	published segments or worked out and published by searchSegment(). Both
+	eyes clip the segments to the lead eye's bbox, and columns outside it
+	have no matches. Returns 0 if aborted.
+ */
+const unsigned short* GinzburgDenoiseFilterPlugin::sharedMatches ( int y, int x, int r, ChannelMask channels, ScratchArena& arena, AbortPoll& poll )
+{
+	GinzburgDenoiseFilterPlugin* first = static_cast<GinzburgDenoiseFilterPlugin*>(firstOp());
+	const Info& leadInfo = input(followView() ? kPartnerInputs : 0)->info();
+	const int bboxX = leadInfo.x() - _size;
+	const int bboxR = leadInfo.r() + _size;
+
+	unsigned short* shared = arena.allocate<unsigned short>((size_t)(r - x) * kSharedStride);
+	std::fill(shared, shared + (size_t)(r - x) * kSharedStride, 0);
+	const int firstSegment = (int)floor((double)std::max(x, bboxX) / kSharedSegment);
+	for (int s = firstSegment; s * kSharedSegment < std::min(r, bboxR); s++) {
+		const int sx = std::max(s * kSharedSegment, bboxX);
+		const int sr = std::min((s + 1) * kSharedSegment, bboxR);
+		const SharedRowKey key = { outputContext().frame(), _leadView, _sharedHash, y, sx, _settingsKey };
+		unsigned short* segment = arena.allocate<unsigned short>((size_t)(sr - sx) * kSharedStride);
+		if (!first->findSharedRow(key, sr - sx, segment)) {
+			if (!searchSegment(y, sx, sr, channels, segment, arena, poll))
+				return 0;
+			first->storeSharedRow(key, sr - sx, segment);
+		}
+		const int c0 = std::max(sx, x), c1 = std::min(sr, r);
+		if (c0 < c1)
+			std::copy(segment + (size_t)(c0 - sx) * kSharedStride, segment + (size_t)(c1 - sx) * kSharedStride,
+					  shared + (size_t)(c0 - x) * kSharedStride);
+	}
+	return shared;
+}
 
-		for(int k1 = 0; k1 < 6; k1++){
-			temporalPointsXY[k1][0] = 0;
-			temporalPointsXY[k1][1] = 0;
+/*! Works out the lead eye's matches of row y, columns x..r of one segment,
+	from the lead view's inputs in tiles over just that segment, the way any
+	eye does, into shared. Returns false if aborted.
+ */
+bool GinzburgDenoiseFilterPlugin::searchSegment ( int y, int x, int r, ChannelMask channels, unsigned short* shared, ScratchArena& arena, AbortPoll& poll )
+{
+	ScratchArena::Scope scope(arena, 0);
+	RowFrames frames;
+	if (!fetchRow(y, x, r, channels, frames, arena, followView() ? kPartnerInputs : 0, true))
+		return false;
+	// Bounded by the lead eye's bbox rather than either eye's request.
+	const Info& leadInfo = input(followView() ? kPartnerInputs : 0)->info();
+	frames.sampleR = leadInfo.r() + _size;
+	frames.sampleT = leadInfo.t() + _size;
+
+	for (int i = x; i < r; i++) {
+		float points[kMaxCandidates][2];
+		float maxDist[kMaxCandidates];
+		float weights[kMaxCandidates];
+		float matches[18];
+		if (!searchPixel(frames, i, y, 0, points, maxDist, weights, poll))
+			return false;
+		for (int k = 0; k < 6; k++) {
+			matches[k * 3] = points[k][0];
+			matches[k * 3 + 1] = points[k][1];
+			matches[k * 3 + 2] = weights[k];
 		}
+		packMatches(matches, i, y, &shared[(i - x) * kSharedStride]);
+	}
+	return true;
+}
+
+/*! Called after each completed output row y. Once the quick pass of
+	progressive mode has delivered every requested row the full pass is
+	scheduled. Rows outside the request and rows done twice do not count.
+ */
+void GinzburgDenoiseFilterPlugin::rowDone ( int y )
+{
+	if (!_quickPass)
+		return;
+	{
+		Guard guard(_refineLock);
+		if (y < _refineY || y >= _refineT || _refineGeneration != _passGeneration)
+			return;
+		const int bit = y - _refineRowY;
+		unsigned& word = _refineRowBits[bit / 32];
+		if (word & (1u << (bit % 32)))
+			return;
+		word |= 1u << (bit % 32);
+		if (--_refineRowsLeft != 0)
+			return;
+	}
+	GinzburgDenoiseFilterPlugin* first = static_cast<GinzburgDenoiseFilterPlugin*>(firstOp());
+	{
+		Guard guard(first->_refineLock);
+		if (first->_refinePass != _passGeneration)
+			return;
+		first->_refinePass = _passGeneration + 1;
+	}
+	asapUpdate();
+}
 
-		for(int k2 = 0; k2 < 6; k2++){
-			sumWeightXY[k2] = 0;
+//! Minimum and maximum of a channel over the columns c0..c1 of all rows of t.
+static void columnRange ( Tile& t, Channel z, int c0, int c1, float& lo, float& hi )
+{
+	c0 = t.clampx(c0);
+	c1 = t.clampx(c1);
+	lo = hi = t[z][t.clampy(t.y())][c0];
+	for (int ty = t.y(); ty < t.t(); ty++) {
+		const float* line = t[z][t.clampy(ty)];
+		for (int tx = c0; tx <= c1; tx++) {
+			lo = std::min(lo, line[tx]);
+			hi = std::max(hi, line[tx]);
 		}
+	}
+}
 
-		maxDist[0] = 1000000;
-		maxDist[1] = 1000000;
-		maxDist[2] = 1000000;
-		maxDist[3] = 1000000;
-		maxDist[4] = 1000000;
-		maxDist[5] = 1000000;
+//! Adds mult times the motion vector range over the given columns of t to the trace range.
+static void extendTrace ( Tile& t, const Channel* mv, float mult, int c0, int c1, float* traceLo, float* traceHi )
+{
+	for (int d = 0; d < 2; d++) {
+		float lo, hi;
+		columnRange(t, mv[d], c0, c1, lo, hi);
+		traceLo[d] += std::min(lo * mult, hi * mult);
+		traceHi[d] += std::max(lo * mult, hi * mult);
+	}
+}
 
-		resultValue[0] = tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)];
-		resultValue[1] = tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)];
-		resultValue[2] = tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)];
+//! Column blocks of the block statistics of t, which start at t.x().
+static int blockStatsCount ( Tile& t )
+{
+	return (t.r() - t.x() + kBlockSize - 1) / kBlockSize;
+}
 
-		resultValueE[0][0] = tile[_extraChannel[0][0]][tile.clampy(y)][tile.clampx(i)];
-		resultValueE[0][1] = tile[_extraChannel[0][1]][tile.clampy(y)][tile.clampx(i)];
-		resultValueE[0][2] = tile[_extraChannel[0][2]][tile.clampy(y)][tile.clampx(i)];
+//! Position and motion vector bounds of each kBlockSize column block of t over
+//! all its rows, for the block test.
+static void computeBlockStats ( Tile& t, const Channel* position, const Channel* mv, BlockStats* stats )
+{
+	const Channel z[5] = { position[0], position[1], position[2], mv[0], mv[1] };
+	const int nStats = blockStatsCount(t);
+	for (int b = 0; b < nStats; b++) {
+		const int c0 = t.x() + b * kBlockSize;
+		const int c1 = std::min(c0 + kBlockSize, t.r()) - 1;
+		for (int c = 0; c < 5; c++)
+			columnRange(t, z[c], c0, c1, stats[b].lo[c], stats[b].hi[c]);
+	}
+}
 
-		resultValueE[1][0] = tile[_extraChannel[1][0]][tile.clampy(y)][tile.clampx(i)];
-		resultValueE[1][1] = tile[_extraChannel[1][1]][tile.clampy(y)][tile.clampx(i)];
-		resultValueE[1][2] = tile[_extraChannel[1][2]][tile.clampy(y)][tile.clampx(i)];
+//! Bounds of component c of the block statistics of a slot over the blocks
+//! holding the columns c0..c1. Columns outside the row fall in its end blocks.
+static void statsRange ( const RowFrames& frames, int slot, int c, int c0, int c1, float& lo, float& hi )
+{
+	const BlockStats* stats = frames.stats[slot];
+	const int nStats = frames.nStats[slot];
+	const int b0 = std::max(0, std::min(nStats - 1, (c0 - frames.statsX[slot]) / kBlockSize));
+	const int b1 = std::max(b0, std::min(nStats - 1, (c1 - frames.statsX[slot]) / kBlockSize));
+	lo = stats[b0].lo[c];
+	hi = stats[b0].hi[c];
+	for (int b = b0 + 1; b <= b1; b++) {
+		lo = std::min(lo, stats[b].lo[c]);
+		hi = std::max(hi, stats[b].hi[c]);
+	}
+}
 
-		resultValueE[2][0] = tile[_extraChannel[2][0]][tile.clampy(y)][tile.clampx(i)];
-		resultValueE[2][1] = tile[_extraChannel[2][1]][tile.clampy(y)][tile.clampx(i)];
-		resultValueE[2][2] = tile[_extraChannel[2][2]][tile.clampy(y)][tile.clampx(i)];
+//! Adds mult times the motion vector bounds of a slot over the columns c0..c1
+//! to the trace range.
+static void statsTrace ( const RowFrames& frames, int slot, float mult, int c0, int c1, float* traceLo, float* traceHi )
+{
+	for (int d = 0; d < 2; d++) {
+		float lo, hi;
+		statsRange(frames, slot, 3 + d, c0, c1, lo, hi);
+		traceLo[d] += std::min(lo * mult, hi * mult);
+		traceHi[d] += std::max(lo * mult, hi * mult);
+	}
+}
 
-		resultValueE[3][0] = tile[_extraChannel[3][0]][tile.clampy(y)][tile.clampx(i)];
-		resultValueE[3][1] = tile[_extraChannel[3][1]][tile.clampy(y)][tile.clampx(i)];
-		resultValueE[3][2] = tile[_extraChannel[3][2]][tile.clampy(y)][tile.clampx(i)];
+/*! Fetches the tiles of row y between x and r for the current frame and the
+	neighbour frames of this pass, running the block test on the guide tiles
+	before any full neighbour tile is fetched. In batch mode the block
+	statistics and packed guides of each input row are taken from, or added
+	to, the batch cache. base is the input of the current frame, 0, or
+	kPartnerInputs for the lead eye's frames in the follow eye; only the
+	former gets the other eye candidate, and only if the row is not fetched
+	just for the temporal search. Returns false if aborted.
+ */
+bool GinzburgDenoiseFilterPlugin::fetchRow ( int y, int x, int r, ChannelMask channels, RowFrames& frames, ScratchArena& arena, int base,
+											 bool searchOnly )
+{
+	const int nNeighbours = _passFrames - 1;
+	const bool otherEye = base == 0 && !searchOnly && otherEyeCandidate();
+	ChannelSet c1 = inputChannels(channels);
+	frames.sampleR = xMax;
+	frames.sampleT = yMax;
+
+	// Input of each slot.
+	int inputs[kMaxCandidates + 1];
+	for (int k = 0; k < kMaxCandidates; k++)
+		inputs[k] = base + k;
+	inputs[kMaxCandidates] = kPartnerInputs;
+
+	ChannelSet guideChannels;
+	guideChannels += _mv[0];
+	guideChannels += _mv[1];
+	for (int c = 0; c < 3; c++)
+		guideChannels += _position[c];
+
+	ChannelSet kernelChannels;
+	kernelChannels += _depth[0];
+	for (int c = 0; c < 3; c++) {
+		kernelChannels += _beauty[c];
+		kernelChannels += _albedo[c];
+		for (int e = 0; e < 4; e++)
+			kernelChannels += _extraChannel[e][c];
+		if (_features)
+			kernelChannels += _normal[c];
+	}
 
-		albedoValue0[0] = tile[_albedo[0]][ tile.clampy(y)][ tile.clampx(i)];
-		albedoValue0[1] = tile[_albedo[1]][ tile.clampy(y)][ tile.clampx(i)];
-		albedoValue0[2] = tile[_albedo[2]][ tile.clampy(y)][ tile.clampx(i)];
+	const int bases = base == 0 ? 0 : 1;
+	if (_features && !_basesReady[bases])
+		return false;
+
+	frames.full[0] = newTile(arena, *input(base), x, y, r, c1);
+	frames.guide[0] = frames.full[0];
+	for (int k = 1; k <= kMaxCandidates; k++)
+		if (k <= nNeighbours || (k == kMaxCandidates && otherEye))
+			frames.guide[k] = newTile(arena, *input(inputs[k]), x, y, r, guideChannels);
+	if ( aborted() )
+		return false;
+
+	// Block statistics and packed guides come from the batch cache when
+	// another output frame of the batch already prepared that input row.
+	GinzburgDenoiseFilterPlugin* first = static_cast<GinzburgDenoiseFilterPlugin*>(firstOp());
+	const bool batch = _batchFrames > 1;
+	FrameRowKey keys[kMaxCandidates + 1];
+	bool statsCached[kMaxCandidates + 1];
+	for (int k = 0; k <= kMaxCandidates; k++) {
+		statsCached[k] = false;
+		if (!frames.guide[k])
+			continue;
+		if (batch)
+			keys[k] = frameRowKey(inputs[k], y, x, r);
+		// The tile is clipped to the input's bbox; its blocks start at its own x.
+		frames.statsX[k] = frames.guide[k]->x();
+		frames.nStats[k] = blockStatsCount(*frames.guide[k]);
+		frames.stats[k] = arena.allocate<BlockStats>(frames.nStats[k]);
+		statsCached[k] = batch && first->loadCachedStats(keys[k], frames.stats[k], frames.nStats[k]);
+		if (!statsCached[k])
+			computeBlockStats(*frames.guide[k], _position, _mv, frames.stats[k]);
+	}
 
-		beautyValue0[0] = tile[_beauty[0]][ tile.clampy(y)][ tile.clampx(i)];
-		beautyValue0[1] = tile[_beauty[1]][ tile.clampy(y)][ tile.clampx(i)];
-		beautyValue0[2] = tile[_beauty[2]][ tile.clampy(y)][ tile.clampx(i)];
-		
-		normalValue0[0] = tile[_normal[0]][ tile.clampy(y)][ tile.clampx(i)];
-		normalValue0[1] = tile[_normal[1]][ tile.clampy(y)][ tile.clampx(i)];
-		normalValue0[2] = tile[_normal[2]][ tile.clampy(y)][ tile.clampx(i)];
+	testBlocks(y, x, r, frames, arena);
 
-		depthValue = tile[_depth[0]][ tile.clampy(y)][ tile.clampx(i)];
+	const int nBlocks = (r - x + kBlockSize - 1) / kBlockSize;
+	for (int k = 1; k <= kMaxCandidates; k++) {
+		bool used = false;
+		for (int b = 0; b < nBlocks && !used && frames.guide[k]; b++)
+			used = frames.usable[b * kMaxCandidates + k - 1] != 0;
+		if (used)
+			frames.full[k] = newTile(arena, *input(inputs[k]), x, y, r, kernelChannels);
+	}
+	if ( aborted() )
+		return false;
+
+	// The colour of the neighbour frames is read at motion vector displaced
+	// positions, so it is copied into bricks over each clipped tile, like the
+	// guides. Feature mode replaces the packed guides by the projected
+	// features.
+	for (int k = 1; k <= kMaxCandidates; k++)
+		if (frames.full[k])
+			packColour(*frames.full[k], frames.colour[k], arena);
+	for (int k = 0; k <= kMaxCandidates; k++) {
+		if (!frames.guide[k])
+			continue;
+		if (!frames.full[k] || _features) {
+			if (batch && !statsCached[k])
+				first->storeFrameRow(keys[k], frames.stats[k], frames.nStats[k], 0);
+			if (frames.full[k])
+				packFeatures(*frames.guide[k], *frames.full[k], _frameBases[bases], k == 0, frames.features[k], arena);
+			continue;
+		}
+		const bool withNormals = k == 0;
+		const bool guidesCached = batch && first->loadCachedGuides(keys[k], withNormals, frames.packed[k], arena);
+		if (!guidesCached)
+			packGuides(*frames.guide[k], *frames.full[k], y, withNormals, frames.packed[k], arena);
+		if (batch && !(statsCached[k] && guidesCached))
+			first->storeFrameRow(keys[k], frames.stats[k], frames.nStats[k], &frames.packed[k]);
+	}
+	return true;
+}
 
+/*! Constructs the tile of row y, columns x..r, of input, with _size pixels
+	around it, in arena storage. The arena is not rewound before the RowFrames
+	holding it is destroyed, so the allocation per row is one bump.
+ */
+Tile* GinzburgDenoiseFilterPlugin::newTile ( ScratchArena& arena, Iop& input, int y, int x, int r, const ChannelSet& channels )
+{
+	return new (arena.allocate<Tile>(1)) Tile( input, x - _size, y - _size, r + _size, y + _size, channels);
+}
 
-		for ( int px = -searchRadius; px < searchRadius+1; px++ )
-			for ( int py = -searchRadius; py < searchRadius+1; py++ ) {
+//! Batch cache key of the row y, columns x..r, of input n.
+FrameRowKey GinzburgDenoiseFilterPlugin::frameRowKey ( int n, int y, int x, int r ) const
+{
+	OutputContext context;
+	inputContext(0, n, context);
+	FrameRowKey key;
+	key.frame = context.frame();
+	key.view = context.view();
+	key.hash = input(n)->hash().value();
+	key.y = y;
+	key.x = x;
+	key.r = r;
+	key.size = _size;
+	key.settings = _frameRowSettings;
+	return key;
+}
+
+//! Copies the cached block statistics of key into stats. Returns false if
+//! the row has not been prepared yet.
+bool GinzburgDenoiseFilterPlugin::loadCachedStats ( const FrameRowKey& key, BlockStats* stats, int nStats )
+{
+	Guard guard(_batchLock);
+	std::map<FrameRowKey, FrameRow>::const_iterator it = _frameRows.find(key);
+	if (it == _frameRows.end() || (int)it->second.stats.size() != nStats)
+		return false;
+	std::copy(it->second.stats.begin(), it->second.stats.end(), stats);
+	return true;
+}
+
+/*! Copies the cached packed guides of key into buffer, allocated from the
+	arena. Returns false if they have not been packed yet, or without the
+	normals when withNormals is set.
+ */
+bool GinzburgDenoiseFilterPlugin::loadCachedGuides ( const FrameRowKey& key, bool withNormals, GuideBuffer& buffer, ScratchArena& arena )
+{
+	Guard guard(_batchLock);
+	std::map<FrameRowKey, FrameRow>::const_iterator it = _frameRows.find(key);
+	if (it == _frameRows.end() || it->second.pixels.empty() || (withNormals && it->second.normals.empty()))
+		return false;
+
+	const FrameRow& row = it->second;
+	buffer.setBounds(row.x, row.y, row.r, row.t);
+	buffer.pixels = arena.allocate<unsigned short>(row.pixels.size());
+	buffer.origins = arena.allocate<float>(row.origins.size());
+	buffer.exactBlocks = arena.allocate<int>(row.exactBlocks.size());
+	buffer.exact = arena.allocate<float>(row.exact.size());
+	std::copy(row.pixels.begin(), row.pixels.end(), buffer.pixels);
+	std::copy(row.origins.begin(), row.origins.end(), buffer.origins);
+	std::copy(row.exactBlocks.begin(), row.exactBlocks.end(), buffer.exactBlocks);
+	std::copy(row.exact.begin(), row.exact.end(), buffer.exact);
+	buffer.normals = 0;
+	if (withNormals) {
+		buffer.normals = arena.allocate<unsigned int>(row.normals.size());
+		std::copy(row.normals.begin(), row.normals.end(), buffer.normals);
+	}
+	return true;
+}
 
-				for(int j = 0; j < 6; j++)
-					for(int j1 = 0; j1 < 2; j1++)
-						mvTrace[j][j1] = 0.0f;
+//! Adds the block statistics and, if given, the packed guides of a prepared
+//! row to the batch cache, keeping whatever the entry already holds. The
+//! oldest rows are dropped while the cache holds more than _batchCacheMB.
+void GinzburgDenoiseFilterPlugin::storeFrameRow ( const FrameRowKey& key, const BlockStats* stats, int nStats, const GuideBuffer* buffer )
+{
+	Guard guard(_batchLock);
+	std::map<FrameRowKey, FrameRow>::iterator it = _frameRows.find(key);
+	if (it == _frameRows.end()) {
+		it = _frameRows.insert(std::make_pair(key, FrameRow())).first;
+		_frameRowOrder.push_back(key);
+	}
+	FrameRow& row = it->second;
+	_frameRowBytes -= row.bytes();
+	if (row.stats.empty())
+		row.stats.assign(stats, stats + nStats);
+	if (buffer && (row.pixels.empty() || (!row.normals.size() && buffer->normals))) {
+		const size_t pixels = buffer->pixelCount();
+		const int nBlocks = buffer->blockCount();
+		int nExact = 0;
+		for (int b = 0; b < nBlocks; b++)
+			nExact += buffer->exactBlocks[b] >= 0;
+		row.x = buffer->x;
+		row.y = buffer->y;
+		row.r = buffer->r;
+		row.t = buffer->t;
+		row.pixels.assign(buffer->pixels, buffer->pixels + pixels * 8);
+		row.origins.assign(buffer->origins, buffer->origins + nBlocks * 4);
+		row.exactBlocks.assign(buffer->exactBlocks, buffer->exactBlocks + nBlocks);
+		row.exact.assign(buffer->exact, buffer->exact + nExact * buffer->exactStride());
+		if (buffer->normals)
+			row.normals.assign(buffer->normals, buffer->normals + pixels);
+	}
+	_frameRowBytes += row.bytes();
+
+	const size_t limit = (size_t)std::max(_batchCacheMB, 0) << 20;
+	while (_frameRowBytes > limit && !_frameRowOrder.empty()) {
+		std::map<FrameRowKey, FrameRow>::iterator oldest = _frameRows.find(_frameRowOrder.front());
+		_frameRowOrder.pop_front();
+		if (oldest == _frameRows.end())
+			continue;
+		_frameRowBytes -= oldest->second.bytes();
+		_frameRows.erase(oldest);
+	}
+}
 
-				// MotionVector tracer
-				if(useMV){
-					mvTrace[0][0] = tile[_mv[0]][tile.clampy(y)][tile.clampx(i)]*MotionVectorMult;
-					mvTrace[0][1] = tile[_mv[1]][tile.clampy(y)][tile.clampx(i)]*MotionVectorMult;
+/*! Drops the cached rows of input frames outside the window of the batch
+	holding frame: the batch's own frames and three on either side.
+ */
+void GinzburgDenoiseFilterPlugin::evictFrameRows ( double frame )
+{
+	const double batchStart = floor(frame / _batchFrames) * _batchFrames;
+	const double lo = batchStart - 3;
+	const double hi = batchStart + _batchFrames - 1 + 3;
+	Guard guard(_batchLock);
+	for (std::map<FrameRowKey, FrameRow>::iterator it = _frameRows.begin(); it != _frameRows.end(); ) {
+		if (it->first.frame < lo || it->first.frame > hi) {
+			_frameRowBytes -= it->second.bytes();
+			_frameRows.erase(it++);
+		} else {
+			++it;
+		}
+	}
+	std::deque<FrameRowKey> order;
+	for (std::deque<FrameRowKey>::const_iterator it = _frameRowOrder.begin(); it != _frameRowOrder.end(); ++it)
+		if (_frameRows.count(*it))
+			order.push_back(*it);
+	_frameRowOrder.swap(order);
+}
 
-					mvTrace[1][0] = tile1[_mv[0]][tile1.clampy(y+mvTrace[0][1])][tile1.clampx(i+mvTrace[0][0])]*MotionVectorMult+mvTrace[0][0];
-					mvTrace[1][1] = tile1[_mv[1]][tile1.clampy(y+mvTrace[0][1])][tile1.clampx(i+mvTrace[0][0])]*MotionVectorMult+mvTrace[0][1];
+/*! Converts the position (from positionTile) and the depth and albedo (from
+	tile) of one frame into buffer. Each block of kBlockSize columns stores
+	position and depth relative to its pixel on row y, so half precision only
+	has to cover the variation within the block. Blocks varying by more than
+	_halfRange keep them as floats, and albedo is clamped to the half range,
+	so no guide turns into an infinity.
+ */
+void GinzburgDenoiseFilterPlugin::packGuides ( Tile& positionTile, Tile& tile, int y, bool withNormals, GuideBuffer& buffer, ScratchArena& arena )
+{
+	buffer.setBounds(tile.x(), tile.y(), tile.r(), tile.t());
+	const int width = buffer.r - buffer.x;
+	const int height = buffer.t - buffer.y;
+	const int nBlocks = buffer.blockCount();
+	const int oy = tile.clampy(y);
+
+	buffer.origins = arena.allocate<float>(nBlocks * 4);
+	buffer.exactBlocks = arena.allocate<int>(nBlocks);
+	int nExact = 0;
+	for (int b = 0; b < nBlocks; b++) {
+		const int b0 = buffer.x + b * kBlockSize;
+		const int b1 = std::min(b0 + kBlockSize, buffer.r);
+		const int ox = tile.clampx(b0 + kBlockSize / 2);
+		float* origin = &buffer.origins[b * 4];
+		for (int c = 0; c < 3; c++)
+			origin[c] = positionTile[_position[c]][oy][ox];
+		origin[3] = tile[_depth[0]][oy][ox];
+
+		// Also catches NaN, which then stays NaN as in the input.
+		bool fits = true;
+		for (int ty = buffer.y; ty < buffer.t && fits; ty++) {
+			const int sy = tile.clampy(ty);
+			for (int sx = b0; sx < b1 && fits; sx++) {
+				for (int c = 0; c < 3; c++)
+					fits = fits && fabs(positionTile[_position[c]][sy][sx] - origin[c]) <= _halfRange[c];
+				fits = fits && fabs(tile[_depth[0]][sy][sx] - origin[3]) <= _halfRange[3];
+			}
+		}
+		buffer.exactBlocks[b] = fits ? -1 : nExact++;
+	}
 
-					mvTrace[2][0] = tile2[_mv[0]][tile2.clampy(y+mvTrace[1][1])][tile2.clampx(i+mvTrace[1][0])]*MotionVectorMult+mvTrace[1][0];
-					mvTrace[2][1] = tile2[_mv[1]][tile2.clampy(y+mvTrace[1][1])][tile2.clampx(i+mvTrace[1][0])]*MotionVectorMult+mvTrace[1][1];
+	buffer.pixels = arena.allocate<unsigned short>(buffer.pixelCount() * 8);
+	buffer.exact = arena.allocate<float>(nExact * buffer.exactStride());
+	buffer.normals = withNormals ? arena.allocate<unsigned int>(buffer.pixelCount()) : 0;
+	for (int ty = 0; ty < height; ty++) {
+		const int sy = tile.clampy(buffer.y + ty);
+		for (int tx = 0; tx < width; tx++) {
+			const int sx = buffer.x + tx;
+			const int b = tx / kBlockSize;
+			const size_t offset = brickOffset(tx, ty, buffer.bricksPerRow);
+			unsigned short* p = &buffer.pixels[offset * 8];
+			for (int c = 0; c < 3; c++)
+				p[4 + c] = floatToHalf(std::max(-kHalfMax, std::min(kHalfMax, tile[_albedo[c]][sy][sx])));
+			p[7] = 0;
+
+			if (buffer.exactBlocks[b] < 0) {
+				const float* origin = &buffer.origins[b * 4];
+				for (int c = 0; c < 3; c++)
+					p[c] = floatToHalf(positionTile[_position[c]][sy][sx] - origin[c]);
+				p[3] = floatToHalf(tile[_depth[0]][sy][sx] - origin[3]);
+			} else {
+				float* e = &buffer.exact[buffer.exactBlocks[b] * buffer.exactStride() + (ty * kBlockSize + tx % kBlockSize) * 4];
+				for (int c = 0; c < 3; c++)
+					e[c] = positionTile[_position[c]][sy][sx];
+				e[3] = tile[_depth[0]][sy][sx];
+				p[0] = p[1] = p[2] = p[3] = 0;
+			}
 
-					mvTrace[3][0] = -tile4[_mv[0]][tile4.clampy(y+py)][tile4.clampx(i+px)]*MotionVectorMult;
-					mvTrace[3][1] = -tile4[_mv[1]][tile4.clampy(y+py)][tile4.clampx(i+px)]*MotionVectorMult;
+			if (withNormals) {
+				float n[3];
+				for (int c = 0; c < 3; c++)
+					n[c] = tile[_normal[c]][sy][sx];
+				buffer.normals[offset] = encodeNormal(n);
+			}
+		}
+	}
+}
 
-					mvTrace[4][0] = -tile5[_mv[0]][tile5.clampy(y+mvTrace[3][1]+py)][tile5.clampx(i+mvTrace[3][0]+px)]*MotionVectorMult+mvTrace[3][0];
-					mvTrace[4][1] = -tile5[_mv[1]][tile5.clampy(y+mvTrace[3][1]+py)][tile5.clampx(i+mvTrace[3][0]+px)]*MotionVectorMult+mvTrace[3][1];
+/*! Eigen decomposition of the symmetric n x n matrix a, which is destroyed, by
+	cyclic Jacobi rotations. values receives the eigenvalues and the rows of
+	vectors the matching eigenvectors.
+ */
+static void jacobiEigen ( double* a, int n, double* values, double* vectors )
+{
+	for (int p = 0; p < n; p++)
+		for (int q = 0; q < n; q++)
+			vectors[p * n + q] = p == q ? 1.0 : 0.0;
+
+	for (int sweep = 0; sweep < 50; sweep++) {
+		double off = 0;
+		for (int p = 0; p < n; p++)
+			for (int q = p + 1; q < n; q++)
+				off += a[p * n + q] * a[p * n + q];
+		if (off < 1e-24)
+			break;
 
-					mvTrace[5][0] = -tile6[_mv[0]][tile6.clampy(y+mvTrace[4][1]+py)][tile6.clampx(i+mvTrace[4][0]+px)]*MotionVectorMult+mvTrace[4][0];
-					mvTrace[5][1] = -tile6[_mv[1]][tile6.clampy(y+mvTrace[4][1]+py)][tile6.clampx(i+mvTrace[4][0]+px)]*MotionVectorMult+mvTrace[4][1];
+		for (int p = 0; p < n; p++) {
+			for (int q = p + 1; q < n; q++) {
+				const double apq = a[p * n + q];
+				if (fabs(apq) < 1e-30)
+					continue;
+				const double theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+				const double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1));
+				const double c = 1 / sqrt(t * t + 1);
+				const double s = t * c;
+				for (int k = 0; k < n; k++) {
+					const double akp = a[k * n + p], akq = a[k * n + q];
+					a[k * n + p] = c * akp - s * akq;
+					a[k * n + q] = s * akp + c * akq;
 				}
+				for (int k = 0; k < n; k++) {
+					const double apk = a[p * n + k], aqk = a[q * n + k];
+					a[p * n + k] = c * apk - s * aqk;
+					a[q * n + k] = s * apk + c * aqk;
+					const double vpk = vectors[p * n + k], vqk = vectors[q * n + k];
+					vectors[p * n + k] = c * vpk - s * vqk;
+					vectors[q * n + k] = s * vpk + c * vqk;
+				}
+			}
+		}
+	}
+	for (int p = 0; p < n; p++)
+		values[p] = a[p * n + p];
+}
+//! Guide stack of the pixel (tx, ty): position, depth, albedo, normal, beauty.
+void GinzburgDenoiseFilterPlugin::guideStack ( Tile& positionTile, Tile& tile, int ty, int tx, float* g ) const
+{
+	for (int c = 0; c < 3; c++) {
+		g[c] = positionTile[_position[c]][ty][tx];
+		g[4 + c] = tile[_albedo[c]][ty][tx];
+		g[7 + c] = tile[_normal[c]][ty][tx];
+		g[10 + c] = tile[_beauty[c]][ty][tx];
+	}
+	g[3] = tile[_depth[0]][ty][tx];
+}
 
-				// Distance Treshold
-				pDist[0] = sqrt((float)_epsX * (tile[_position[0]][tile.clampy(y)][tile.clampx(i)] - tile1[_position[0]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])*
-								(tile[_position[0]][tile.clampy(y)][tile.clampx(i)] - tile1[_position[0]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])+
-							_epsY * (tile[_position[1]][tile.clampy(y)][tile.clampx(i)] - tile1[_position[1]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])*
-								(tile[_position[1]][tile.clampy(y)][tile.clampx(i)] - tile1[_position[1]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])+
-							_epsZ * (tile[_position[2]][tile.clampy(y)][tile.clampx(i)] - tile1[_position[2]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])*
-								(tile[_position[2]][tile.clampy(y)][tile.clampx(i)] - tile1[_position[2]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)]));
-
-				pDist[1] = sqrt((float)_epsX * (tile[_position[0]][tile.clampy(y)][tile.clampx(i)] - tile2[_position[0]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])*
-								(tile[_position[0]][tile.clampy(y)][tile.clampx(i)] - tile2[_position[0]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])+
-							_epsY * (tile[_position[1]][tile.clampy(y)][tile.clampx(i)] - tile2[_position[1]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])*
-								(tile[_position[1]][tile.clampy(y)][tile.clampx(i)] - tile2[_position[1]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])+
-							_epsZ * (tile[_position[2]][tile.clampy(y)][tile.clampx(i)] - tile2[_position[2]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])*
-								(tile[_position[2]][tile.clampy(y)][tile.clampx(i)] - tile2[_position[2]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)]));
-
-				pDist[2] = sqrt((float)_epsX * (tile[_position[0]][tile.clampy(y)][tile.clampx(i)] - tile3[_position[0]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])*
-								(tile[_position[0]][tile.clampy(y)][tile.clampx(i)] - tile3[_position[0]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])+
-							_epsY * (tile[_position[1]][tile.clampy(y)][tile.clampx(i)] - tile3[_position[1]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])*
-								(tile[_position[1]][tile.clampy(y)][tile.clampx(i)] - tile3[_position[1]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])+
-							_epsZ * (tile[_position[2]][tile.clampy(y)][tile.clampx(i)] - tile3[_position[2]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])*
-								(tile[_position[2]][tile.clampy(y)][tile.clampx(i)] - tile3[_position[2]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)]));
-
-				pDist[3] = sqrt((float)_epsX * (tile[_position[0]][tile.clampy(y)][tile.clampx(i)] - tile4[_position[0]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])*
-								(tile[_position[0]][tile.clampy(y)][tile.clampx(i)] - tile4[_position[0]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])+
-							_epsY * (tile[_position[1]][tile.clampy(y)][tile.clampx(i)] - tile4[_position[1]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])*
-								(tile[_position[1]][tile.clampy(y)][tile.clampx(i)] - tile4[_position[1]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])+
-							_epsZ * (tile[_position[2]][tile.clampy(y)][tile.clampx(i)] - tile4[_position[2]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])*
-								(tile[_position[2]][tile.clampy(y)][tile.clampx(i)] - tile4[_position[2]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)]));
-
-				pDist[4] = sqrt((float)_epsX * (tile[_position[0]][tile.clampy(y)][tile.clampx(i)] - tile5[_position[0]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])*
-								(tile[_position[0]][tile.clampy(y)][tile.clampx(i)] - tile5[_position[0]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])+
-							_epsY * (tile[_position[1]][tile.clampy(y)][tile.clampx(i)] - tile5[_position[1]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])*
-								(tile[_position[1]][tile.clampy(y)][tile.clampx(i)] - tile5[_position[1]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])+
-							_epsZ * (tile[_position[2]][tile.clampy(y)][tile.clampx(i)] - tile5[_position[2]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])*
-								(tile[_position[2]][tile.clampy(y)][tile.clampx(i)] - tile5[_position[2]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)]));
-
-				pDist[5] = sqrt((float)_epsX * (tile[_position[0]][tile.clampy(y)][tile.clampx(i)] - tile6[_position[0]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])*
-								(tile[_position[0]][tile.clampy(y)][tile.clampx(i)] - tile6[_position[0]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])+
-							_epsY * (tile[_position[1]][tile.clampy(y)][tile.clampx(i)] - tile6[_position[1]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])*
-								(tile[_position[1]][tile.clampy(y)][tile.clampx(i)] - tile6[_position[1]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])+
-							_epsZ * (tile[_position[2]][tile.clampy(y)][tile.clampx(i)] - tile6[_position[2]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])*
-								(tile[_position[2]][tile.clampy(y)][tile.clampx(i)] - tile6[_position[2]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)]));
-
-				// color treshold
-				pColor[0] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile1[_beauty[0]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])*
-							(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile1[_beauty[0]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])+
-							(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile1[_beauty[1]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])*
-							(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile1[_beauty[1]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])+
-							(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile1[_beauty[2]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])*
-							(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile1[_beauty[2]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)]));
-
-				pColor[1] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile2[_beauty[0]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])*
-							(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile2[_beauty[0]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])+
-							(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile2[_beauty[1]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])*
-							(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile2[_beauty[1]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])+
-							(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile2[_beauty[2]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])*
-							(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile2[_beauty[2]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)]));
-
-				pColor[2] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile3[_beauty[0]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])*
-							(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile3[_beauty[0]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])+
-							(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile3[_beauty[1]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])*
-							(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile3[_beauty[1]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])+
-							(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile3[_beauty[2]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])*
-							(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile3[_beauty[2]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)]));
-
-				pColor[3] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile4[_beauty[0]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])*
-							(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile4[_beauty[0]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])+
-							(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile4[_beauty[1]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])*
-							(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile4[_beauty[1]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])+
-							(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile4[_beauty[2]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])*
-							(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile4[_beauty[2]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)]));
-
-				pColor[4] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[0]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])*
-							(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[0]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])+
-							(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[1]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])*
-							(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[1]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])+
-							(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[2]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])*
-							(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[2]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)]));
-
-				pColor[5] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[0]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])*
-							(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[0]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])+
-							(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[1]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])*
-							(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[1]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])+
-							(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[2]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])*
-							(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[2]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)]));
-
-				pZtA[0] = sqrt((float)(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile1[_albedo[0]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])*
-							(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile1[_albedo[0]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])+
-							(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile1[_albedo[1]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])*
-							(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile1[_albedo[1]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])+
-							(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile1[_albedo[2]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)])*
-							(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile1[_albedo[2]][tile1.clampy(y+mvTrace[0][1]+py)][tile1.clampx(i+mvTrace[0][0]+px)]));
-
-				pZtA[1] = sqrt((float)(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile2[_albedo[0]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])*
-							(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile2[_albedo[0]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])+
-							(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile2[_albedo[1]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])*
-							(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile2[_albedo[1]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])+
-							(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile2[_albedo[2]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)])*
-							(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile2[_albedo[2]][tile2.clampy(y+mvTrace[1][1]+py)][tile2.clampx(i+mvTrace[1][0]+px)]));
-
-				pZtA[2] = sqrt((float)(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile3[_albedo[0]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])*
-							(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile3[_albedo[0]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])+
-							(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile3[_albedo[1]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])*
-							(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile3[_albedo[1]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])+
-							(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile3[_albedo[2]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)])*
-							(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile3[_albedo[2]][tile3.clampy(y+mvTrace[2][1]+py)][tile3.clampx(i+mvTrace[2][0]+px)]));
-
-				pZtA[3] = sqrt((float)(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile4[_albedo[0]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])*
-							(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile4[_albedo[0]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])+
-							(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile4[_albedo[1]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])*
-							(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile4[_albedo[1]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])+
-							(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile4[_albedo[2]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)])*
-							(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile4[_albedo[2]][tile4.clampy(y+mvTrace[3][1]+py)][tile4.clampx(i+mvTrace[3][0]+px)]));
-
-				pZtA[4] = sqrt((float)(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile5[_albedo[0]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])*
-							(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile5[_albedo[0]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])+
-							(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile5[_albedo[1]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])*
-							(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile5[_albedo[1]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])+
-							(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile5[_albedo[2]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)])*
-							(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile5[_albedo[2]][tile5.clampy(y+mvTrace[4][1]+py)][tile5.clampx(i+mvTrace[4][0]+px)]));
-
-				pZtA[5] = sqrt((float)(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile6[_albedo[0]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])*
-							(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile6[_albedo[0]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])+
-							(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile6[_albedo[1]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])*
-							(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile6[_albedo[1]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])+
-							(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile6[_albedo[2]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)])*
-							(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile6[_albedo[2]][tile6.clampy(y+mvTrace[5][1]+py)][tile6.clampx(i+mvTrace[5][0]+px)]));
-
-				for (int frame = 0; frame < nFrames-1; frame++)
-					if(	(pDist[frame] <= _eps)&&
-						(pColor[frame] <= _epsColor)&&
-						(pZtA[frame] <= _wAt)&&
-						(pDist[frame] < maxDist[frame])&&
-						((i+mvTrace[frame][0]+px)< xMax)&&
-						((i+mvTrace[frame][0]+px)> 0)&&
-						((y+mvTrace[frame][1]+py)< yMax)&&
-						((y+mvTrace[frame][1]+py)> 0)&&
-						(_lic)){
-							maxDist[frame] = pDist[frame]; 
-							temporalPointsXY[frame][0] = i+mvTrace[frame][0]+px;
-							temporalPointsXY[frame][1] = y+mvTrace[frame][1]+py;
-							sumWeightXY[frame] = 1;
-						}
+//! Guide channels feature mode reduces.
+ChannelSet GinzburgDenoiseFilterPlugin::featureChannels () const
+{
+	ChannelSet channels;
+	channels += _depth[0];
+	for (int c = 0; c < 3; c++) {
+		channels += _position[c];
+		channels += _albedo[c];
+		channels += _normal[c];
+		channels += _beauty[c];
+	}
+	return channels;
+}
+
+//! Row s of the kFeatureSampleRows rows the feature bases sample in info.
+static int featureSampleRow ( const Info& info, int s )
+{
+	const int height = info.t() - info.y();
+	return info.y() + (int)((long)height * (2 * s + 1) / (2 * kFeatureSampleRows));
+}
+
+//! Requests the rows of input n featureBases() samples.
+void GinzburgDenoiseFilterPlugin::requestFeatureRows ( int n, int count )
+{
+	const Info& info = input(n)->info();
+	if (info.t() <= info.y())
+		return;
+	input(n) -> request(info.x(), featureSampleRow(info, 0), info.r(), featureSampleRow(info, kFeatureSampleRows - 1) + 1,
+						featureChannels(), count);
+}
+
+/*! Whitens the covariance cov of the guide stack by scale and keeps its
+	leading dims eigenvectors as the axes of basis.
+ */
+static void fitFeatureBasis ( const double* mean, const double* cov, const float* scale, int dims, FeatureBasis& basis )
+{
+	const int n = kGuideComponents;
+	double whitened[kGuideComponents * kGuideComponents];
+	for (int c = 0; c < n; c++)
+		for (int d = 0; d < n; d++)
+			whitened[c * n + d] = cov[c * n + d] * scale[c] * scale[d];
+
+	double values[kGuideComponents];
+	double vectors[kGuideComponents * kGuideComponents];
+	jacobiEigen(whitened, n, values, vectors);
+
+	int order[kGuideComponents];
+	double total = 0;
+	for (int c = 0; c < n; c++) {
+		order[c] = c;
+		total += std::max(values[c], 0.0);
+	}
+	for (int c = 0; c < n; c++)
+		for (int d = c + 1; d < n; d++)
+			if (values[order[d]] > values[order[c]])
+				std::swap(order[c], order[d]);
+
+	double kept = 0;
+	basis.dims = dims;
+	for (int c = 0; c < n; c++) {
+		basis.scale[c] = scale[c];
+		basis.mean[c] = (float)mean[c];
+	}
+	for (int d = 0; d < 4; d++) {
+		const double* axis = &vectors[order[d] * n];
+		for (int c = 0; c < n; c++)
+			basis.axes[d][c] = d < dims ? (float)axis[c] : 0.0f;
+		if (d < dims)
+			kept += std::max(values[order[d]], 0.0);
+	}
+	basis.retained = total > 0 ? (float)(kept / total) : 1.0f;
+}
+
+/*! Projects the guide stack g onto basis. If residual is given, it receives
+	the length of the part of the whitened, centred stack the axes drop.
+ */
+static void projectFeatures ( const FeatureBasis& basis, const float* g, float* f, float* residual )
+{
+	float w[kGuideComponents];
+	float length2 = 0;
+	for (int c = 0; c < kGuideComponents; c++) {
+		w[c] = (g[c] - basis.mean[c]) * basis.scale[c];
+		length2 += w[c] * w[c];
+	}
+	for (int d = 0; d < 4; d++) {
+		float v = 0;
+		for (int c = 0; c < kGuideComponents; c++)
+			v += basis.axes[d][c] * w[c];
+		f[d] = v;
+		length2 -= v * v;
+	}
+	if (residual)
+		*residual = sqrt(std::max(length2, 0.0f));
+}
+
+//! Squared distance between the four features at a and b.
+static inline float featureDist2 ( const float* a, const float* b )
+{
+	float d2 = 0;
+	for (int d = 0; d < 4; d++)
+		d2 += (a[d] - b[d]) * (a[d] - b[d]);
+	return d2;
+}
+
+/*! Finds the feature bases of the current frame, read from input base.
+	Every kFeatureSampleStep-th pixel of kFeatureSampleRows rows of it gives
+	the covariance of the guide stack, which each feature set whitens by its
+	_featureScale before keeping its leading _featureDims eigenvectors. Bases
+	are found once per frame, input hash and _featureKey on firstOp(), and the
+	variance each keeps is reported then. Returns false if aborted.
+ */
+bool GinzburgDenoiseFilterPlugin::featureBases ( FeatureBases& bases, int base )
+{
+	GinzburgDenoiseFilterPlugin* first = static_cast<GinzburgDenoiseFilterPlugin*>(firstOp());
+	FeatureKey key;
+	key.frame = outputContext().frame();
+	key.hash = input(base)->hash().value();
+	key.settings = _featureKey;
+
+	// Held while sampling, so ops opening on the same frame wait for the
+	// first one instead of sampling it again.
+	Guard guard(first->_featureLock);
+	std::map<FeatureKey, FeatureBases>::const_iterator it = first->_featureBases.find(key);
+	if (it != first->_featureBases.end()) {
+		bases = it->second;
+		return true;
+	}
+
+	const int n = kGuideComponents;
+	double mean[kGuideComponents] = { 0 };
+	double cov[kGuideComponents * kGuideComponents] = { 0 };
+	long samples = 0;
+	// The input's own bbox, so the follow eye finds the same bases as the lead.
+	Iop& source = *input(base);
+	const Info& info = source.info();
+	const ChannelSet channels = featureChannels();
+	for (int s = 0; s < kFeatureSampleRows && info.t() > info.y(); s++) {
+		const int sy = featureSampleRow(info, s);
+		Tile row( source, info.x(), sy, info.r(), sy + 1, channels);
+		if ( aborted() )
+			return false;
+		for (int sx = info.x() + s % kFeatureSampleStep; sx < info.r(); sx += kFeatureSampleStep) {
+			float g[kGuideComponents];
+			guideStack(row, row, row.clampy(sy), row.clampx(sx), g);
+			for (int c = 0; c < n; c++) {
+				mean[c] += g[c];
+				for (int d = 0; d < n; d++)
+					cov[c * n + d] += (double)g[c] * g[d];
 			}
+			samples++;
+		}
+	}
+	for (int c = 0; c < n; c++)
+		mean[c] /= std::max(samples, 1L);
+	for (int c = 0; c < n; c++)
+		for (int d = 0; d < n; d++)
+			cov[c * n + d] = cov[c * n + d] / std::max(samples, 1L) - mean[c] * mean[d];
+
+	const int dims = std::max(3, std::min(_featureDims, 4));
+	for (int f = 0; f < 3; f++)
+		fitFeatureBasis(mean, cov, _featureScale[f], dims, bases.set[f]);
+
+	if (first->_featureBases.size() >= 64)
+		first->_featureBases.clear();
+	first->_featureBases[key] = bases;
+	std::cerr << "GinzburgDenoiseFilter: frame " << key.frame << " features keep "
+			  << bases.set[kMatchFeatures].retained * 100 << "% (match), "
+			  << bases.set[kTemporalFeatures].retained * 100 << "% (temporal) and "
+			  << bases.set[kSpatialFeatures].retained * 100 << "% (spatial) of the guide variance in "
+			  << dims << " components" << std::endl;
+	return true;
+}
 
-			// Current channel
-			for ( int px = -kernelRadius; px < kernelRadius+1; px++ )
-				for ( int py = -kernelRadius; py < kernelRadius+1; py++ ){
-					pChannel[0][0] = tile1[_beauty[0]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][1] = tile1[_beauty[1]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][2] = tile1[_beauty[2]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][3] = tile1[_extraChannel[0][0]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][4] = tile1[_extraChannel[0][1]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][5] = tile1[_extraChannel[0][2]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][6] = tile1[_extraChannel[1][0]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][7] = tile1[_extraChannel[1][1]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][8] = tile1[_extraChannel[1][2]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][9] = tile1[_extraChannel[2][0]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][10] = tile1[_extraChannel[2][1]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][11] = tile1[_extraChannel[2][2]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][12] = tile1[_extraChannel[3][0]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][13] = tile1[_extraChannel[3][1]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-					pChannel[0][14] = tile1[_extraChannel[3][2]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)];
-
-					pChannel[1][0] = tile2[_beauty[0]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][1] = tile2[_beauty[1]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][2] = tile2[_beauty[2]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][3] = tile2[_extraChannel[0][0]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][4] = tile2[_extraChannel[0][1]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][5] = tile2[_extraChannel[0][2]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][6] = tile2[_extraChannel[1][0]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][7] = tile2[_extraChannel[1][1]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][8] = tile2[_extraChannel[1][2]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][9] = tile2[_extraChannel[2][0]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][10] = tile2[_extraChannel[2][1]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][11] = tile2[_extraChannel[2][2]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][12] = tile2[_extraChannel[3][0]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][13] = tile2[_extraChannel[3][1]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-					pChannel[1][14] = tile2[_extraChannel[3][2]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)];
-
-					pChannel[2][0] = tile3[_beauty[0]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][1] = tile3[_beauty[1]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][2] = tile3[_beauty[2]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][3] = tile3[_extraChannel[0][0]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][4] = tile3[_extraChannel[0][1]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][5] = tile3[_extraChannel[0][2]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][6] = tile3[_extraChannel[1][0]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][7] = tile3[_extraChannel[1][1]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][8] = tile3[_extraChannel[1][2]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][9] = tile3[_extraChannel[2][0]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][10] = tile3[_extraChannel[2][1]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][11] = tile3[_extraChannel[2][2]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][12] = tile3[_extraChannel[3][0]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][13] = tile3[_extraChannel[3][1]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-					pChannel[2][14] = tile3[_extraChannel[3][2]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)];
-
-					pChannel[3][0] = tile4[_beauty[0]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][1] = tile4[_beauty[1]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][2] = tile4[_beauty[2]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][3] = tile4[_extraChannel[0][0]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][4] = tile4[_extraChannel[0][1]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][5] = tile4[_extraChannel[0][2]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][6] = tile4[_extraChannel[1][0]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][7] = tile4[_extraChannel[1][1]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][8] = tile4[_extraChannel[1][2]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][9] = tile4[_extraChannel[2][0]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][10] = tile4[_extraChannel[2][1]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][11] = tile4[_extraChannel[2][2]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][12] = tile4[_extraChannel[3][0]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][13] = tile4[_extraChannel[3][1]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-					pChannel[3][14] = tile4[_extraChannel[3][2]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)];
-
-					pChannel[4][0] = tile5[_beauty[0]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][1] = tile5[_beauty[1]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][2] = tile5[_beauty[2]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][3] = tile5[_extraChannel[0][0]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][4] = tile5[_extraChannel[0][1]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][5] = tile5[_extraChannel[0][2]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][6] = tile5[_extraChannel[1][0]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][7] = tile5[_extraChannel[1][1]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][8] = tile5[_extraChannel[1][2]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][9] = tile5[_extraChannel[2][0]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][10] = tile5[_extraChannel[2][1]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][11] = tile5[_extraChannel[2][2]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][12] = tile5[_extraChannel[3][0]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][13] = tile5[_extraChannel[3][1]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-					pChannel[4][14] = tile5[_extraChannel[3][2]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)];
-
-					pChannel[5][0] = tile6[_beauty[0]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][1] = tile6[_beauty[1]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][2] = tile6[_beauty[2]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][3] = tile6[_extraChannel[0][0]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][4] = tile6[_extraChannel[0][1]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][5] = tile6[_extraChannel[0][2]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][6] = tile6[_extraChannel[1][0]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][7] = tile6[_extraChannel[1][1]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][8] = tile6[_extraChannel[1][2]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][9] = tile6[_extraChannel[2][0]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][10] = tile6[_extraChannel[2][1]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][11] = tile6[_extraChannel[2][2]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][12] = tile6[_extraChannel[3][0]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][13] = tile6[_extraChannel[3][1]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-					pChannel[5][14] = tile6[_extraChannel[3][2]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)];
-
-					pZt[0] =  abs(tile[_depth[0]][tile.clampy(y)][tile.clampx(i)] - tile1[_depth[0]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)]);
-					pZt[1] =  abs(tile[_depth[0]][tile.clampy(y)][tile.clampx(i)] - tile2[_depth[0]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)]);
-					pZt[2] =  abs(tile[_depth[0]][tile.clampy(y)][tile.clampx(i)] - tile3[_depth[0]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)]);
-					pZt[3] =  abs(tile[_depth[0]][tile.clampy(y)][tile.clampx(i)] - tile4[_depth[0]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)]);
-					pZt[4] =  abs(tile[_depth[0]][tile.clampy(y)][tile.clampx(i)] - tile5[_depth[0]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)]);
-					pZt[5] =  abs(tile[_depth[0]][tile.clampy(y)][tile.clampx(i)] - tile6[_depth[0]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)]);
-
-					pZtA[0] = sqrt((float)(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile1[_albedo[0]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)])*
-								(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile1[_albedo[0]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)])+
-								(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile1[_albedo[1]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)])*
-								(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile1[_albedo[1]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)])+
-								(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile1[_albedo[2]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)])*
-								(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile1[_albedo[2]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)]));
-					pZtA[1] = sqrt((float)(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile2[_albedo[0]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)])*
-								(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile2[_albedo[0]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)])+
-								(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile2[_albedo[1]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)])*
-								(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile2[_albedo[1]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)])+
-								(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile2[_albedo[2]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)])*
-								(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile2[_albedo[2]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)]));
-					pZtA[2] = sqrt((float)(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile3[_albedo[0]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)])*
-								(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile3[_albedo[0]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)])+
-								(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile3[_albedo[1]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)])*
-								(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile3[_albedo[1]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)])+
-								(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile3[_albedo[2]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)])*
-								(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile3[_albedo[2]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)]));
-					pZtA[3] = sqrt((float)(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile4[_albedo[0]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)])*
-								(tile[_albedo[0]][tile.clampy(y)][tile.clampx(i)] - tile4[_albedo[0]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)])+
-								(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile4[_albedo[1]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)])*
-								(tile[_albedo[1]][tile.clampy(y)][tile.clampx(i)] - tile4[_albedo[1]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)])+
-								(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile4[_albedo[2]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)])*
-								(tile[_albedo[2]][tile.clampy(y)][tile.clampx(i)] - tile4[_albedo[2]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)]));
-					pZtA[4] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[0]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)])*
-								(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[0]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)])+
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[1]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)])*
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[1]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)])+
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[2]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)])*
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[2]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)]));
-					pZtA[5] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[0]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)])*
-								(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[0]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)])+
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[1]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)])*
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[1]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)])+
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[2]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)])*
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[2]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)]));
-
-					pColor[0] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile1[_beauty[0]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)])*
-								(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile1[_beauty[0]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)])+
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile1[_beauty[1]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)])*
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile1[_beauty[1]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)])+
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile1[_beauty[2]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)])*
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile1[_beauty[2]][tile1.clampy(temporalPointsXY[0][1]+py)][tile1.clampx(temporalPointsXY[0][0]+px)]));
-					pColor[1] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile2[_beauty[0]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)])*
-								(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile2[_beauty[0]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)])+
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile2[_beauty[1]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)])*
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile2[_beauty[1]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)])+
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile2[_beauty[2]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)])*
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile2[_beauty[2]][tile2.clampy(temporalPointsXY[1][1]+py)][tile2.clampx(temporalPointsXY[1][0]+px)]));
-					pColor[2] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile3[_beauty[0]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)])*
-								(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile3[_beauty[0]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)])+
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile3[_beauty[1]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)])*
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile3[_beauty[1]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)])+
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile3[_beauty[2]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)])*
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile3[_beauty[2]][tile3.clampy(temporalPointsXY[2][1]+py)][tile3.clampx(temporalPointsXY[2][0]+px)]));
-					pColor[3] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile4[_beauty[0]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)])*
-								(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile4[_beauty[0]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)])+
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile4[_beauty[1]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)])*
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile4[_beauty[1]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)])+
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile4[_beauty[2]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)])*
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile4[_beauty[2]][tile4.clampy(temporalPointsXY[3][1]+py)][tile4.clampx(temporalPointsXY[3][0]+px)]));
-					pColor[4] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[0]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)])*
-								(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[0]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)])+
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[1]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)])*
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[1]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)])+
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[2]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)])*
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile5[_beauty[2]][tile5.clampy(temporalPointsXY[4][1]+py)][tile5.clampx(temporalPointsXY[4][0]+px)]));
-					pColor[5] = sqrt((float)(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[0]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)])*
-								(tile[_beauty[0]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[0]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)])+
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[1]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)])*
-								(tile[_beauty[1]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[1]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)])+
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[2]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)])*
-								(tile[_beauty[2]][tile.clampy(y)][tile.clampx(i)] - tile6[_beauty[2]][tile6.clampy(temporalPointsXY[5][1]+py)][tile6.clampx(temporalPointsXY[5][0]+px)]));
-
-					albedoValue1[0] = tile[_albedo[0]][ tile.clampy(y + py)][ tile.clampx(i + px)];
-					albedoValue1[1] = tile[_albedo[1]][ tile.clampy(y + py)][ tile.clampx(i + px)];
-					albedoValue1[2] = tile[_albedo[2]][ tile.clampy(y + py)][ tile.clampx(i + px)];
-
-					beautyValue1[0] = tile[_beauty[0]][ tile.clampy(y + py)][ tile.clampx(i + px)];
-					beautyValue1[1] = tile[_beauty[1]][ tile.clampy(y + py)][ tile.clampx(i + px)];
-					beautyValue1[2] = tile[_beauty[2]][ tile.clampy(y + py)][ tile.clampx(i + px)];
-
-					normalValue1[0] = tile[_normal[0]][ tile.clampy(y + py)][ tile.clampx(i + px)];
-					normalValue1[1] = tile[_normal[1]][ tile.clampy(y + py)][ tile.clampx(i + px)];
-					normalValue1[2] = tile[_normal[2]][ tile.clampy(y + py)][ tile.clampx(i + px)];
-
-					beautyDist = sqrt((float)(beautyValue0[0]-beautyValue1[0])*(beautyValue0[0]-beautyValue1[0])+
-								(beautyValue0[1]-beautyValue1[1])*(beautyValue0[1]-beautyValue1[1])+
-								(beautyValue0[2]-beautyValue1[2])*(beautyValue0[2]-beautyValue1[2]));
-
-					albedoDist = sqrt((float)(albedoValue0[0]-albedoValue1[0])*(albedoValue0[0]-albedoValue1[0])+
-								(albedoValue0[1]-albedoValue1[1])*(albedoValue0[1]-albedoValue1[1])+
-								(albedoValue0[2]-albedoValue1[2])*(albedoValue0[2]-albedoValue1[2]));
-
-					depthDist = abs(depthValue - tile[_depth[0]][ tile.clampy(y + py)][ tile.clampx(i + px) ]);
-
-					normalDist = sqrt((float)(normalValue0[0]-normalValue1[0])*(normalValue0[0]-normalValue1[0])+ 
-								(normalValue0[1]-normalValue1[1])*(normalValue0[1]-normalValue1[1])+
-								(normalValue0[2]-normalValue1[2])*(normalValue0[2]-normalValue1[2]));
-
-					positionDist = sqrt((float)px*px+py*py);
-
-					spatTemporalWeight = 0;
-
-					for(int k = 0; k < nFrames-1; k++){
-						spatTemporalWeight += sumWeightXY[k]/(nFrames-1);
-					}
+/*! Projects the guide stack of every pixel of tile onto the match and
+	temporal bases, and for the current frame the spatial one, into buffer
+	in the layout of kFeatureStride and kCurrentFeatureStride.
+ */
+void GinzburgDenoiseFilterPlugin::packFeatures ( Tile& positionTile, Tile& tile, const FeatureBases& bases, bool current,
+												 BrickBuffer& buffer, ScratchArena& arena )
+{
+	const int width = tile.r() - tile.x();
+	const int height = tile.t() - tile.y();
+	buffer.allocate(tile, current ? kCurrentFeatureStride : kFeatureStride, arena);
+	for (int ty = 0; ty < height; ty++) {
+		const int sy = tile.clampy(tile.y() + ty);
+		for (int tx = 0; tx < width; tx++) {
+			float g[kGuideComponents];
+			guideStack(positionTile, tile, sy, tile.clampx(tile.x() + tx), g);
+			float* f = &buffer.data[brickOffset(tx, ty, buffer.bricksPerRow) * buffer.stride];
+			projectFeatures(bases.set[kMatchFeatures], g, f, &f[4]);
+			f[5] = f[6] = f[7] = 0;
+			projectFeatures(bases.set[kTemporalFeatures], g, &f[8], 0);
+			if (current)
+				projectFeatures(bases.set[kSpatialFeatures], g, &f[12], 0);
+		}
+	}
+}
 
-				for(int k = 0; k < nFrames-1; k++){	
-					pPos = sqrt((float)(px*px+py*py));
-					currentWeight = sumWeightXY[k]*_wT/(exp((pZt[k]/_wDist)*(pZt[k]/_wDist)*0.5)*
-									exp((pColor[k]/_wColor)*(pColor[k]/_wColor)*0.5)*
-									exp((pZtA[k]/_wAt)*(pZtA[k]/_wAt)*0.5)*
-									exp((pPos/_wPosition)*(pPos/_wPosition)*0.5));
+//! Copies the beauty and extra channels of tile into buffer, sixteen floats
+//! per pixel in the order of denoisePixel()'s result.
+void GinzburgDenoiseFilterPlugin::packColour ( Tile& tile, BrickBuffer& buffer, ScratchArena& arena )
+{
+	const int width = tile.r() - tile.x();
+	const int height = tile.t() - tile.y();
+	buffer.allocate(tile, 16, arena);
+	for (int ty = 0; ty < height; ty++) {
+		const int sy = tile.clampy(tile.y() + ty);
+		for (int tx = 0; tx < width; tx++) {
+			const int sx = tile.clampx(tile.x() + tx);
+			float* p = &buffer.data[brickOffset(tx, ty, buffer.bricksPerRow) * 16];
+			for (int c = 0; c < 3; c++) {
+				p[c] = tile[_beauty[c]][sy][sx];
+				for (int e = 0; e < 4; e++)
+					p[3 + e * 3 + c] = tile[_extraChannel[e][c]][sy][sx];
+			}
+			p[15] = 0;
+		}
+	}
+}
 
-					// currentWeight *= sumWeightXY[k];
-					resultValue[0] += pChannel[k][0]*currentWeight;
-					resultValue[1] += pChannel[k][1]*currentWeight;
-					resultValue[2] += pChannel[k][2]*currentWeight;
+/*! Decides per block of kBlockSize pixels of row y which neighbour frames can
+	contribute. The motion vector ranges of the guide tiles bound the columns
+	any trace plus search offset of the block can reach in each neighbour, and
+	the disparity range those in the other eye. If the position bounding box
+	over those columns is further than _eps from the bounding box of the
+	block, no pixel of the block can pass the distance threshold, so the frame
+	is dropped for the block. The test never rejects a match the per-pixel
+	search would accept, in feature mode too, whose test implies the _eps
+	one; it only catches frames across a cut or a complete disocclusion early.
+ */
+void GinzburgDenoiseFilterPlugin::testBlocks ( int y, int x, int r, RowFrames& frames, ScratchArena& arena )
+{
+	const int nNeighbours = _passFrames - 1;
+	const int nBlocks = (r - x + kBlockSize - 1) / kBlockSize;
+	const float mult = MotionVectorMult;
+	const int s = _passSearchRadius;
+	Tile& tile = *frames.full[0];
+	const int cy = tile.clampy(y);
+
+	frames.x = x;
+	frames.usable = arena.allocate<unsigned char>(nBlocks * kMaxCandidates);
+	std::fill(frames.usable, frames.usable + nBlocks * kMaxCandidates, 0);
+
+	for (int b = 0; b < nBlocks; b++) {
+		const int b0 = x + b * kBlockSize;
+		const int b1 = std::min(b0 + kBlockSize, r) - 1;
+
+		float blockLo[3], blockHi[3];
+		for (int c = 0; c < 3; c++) {
+			blockLo[c] = blockHi[c] = tile[_position[c]][cy][tile.clampx(b0)];
+			for (int i = b0; i <= b1; i++) {
+				const float v = tile[_position[c]][cy][tile.clampx(i)];
+				blockLo[c] = std::min(blockLo[c], v);
+				blockHi[c] = std::max(blockHi[c], v);
+			}
+		}
 
-					resultValueE[0][0] += pChannel[k][3]*currentWeight;
-					resultValueE[0][1] += pChannel[k][4]*currentWeight;
-					resultValueE[0][2] += pChannel[k][5]*currentWeight;
+		// Range of the motion vector trace into each neighbour, see denoisePixel().
+		float traceLo[kMaxCandidates][2], traceHi[kMaxCandidates][2];
+		for (int k = 0; k < kMaxCandidates; k++)
+			traceLo[k][0] = traceLo[k][1] = traceHi[k][0] = traceHi[k][1] = 0.0f;
+		if (useMV) {
+			for (int k = 0; k < std::min(3, nNeighbours); k++) {
+				if (k > 0) {
+					traceLo[k][0] = traceLo[k-1][0]; traceLo[k][1] = traceLo[k-1][1];
+					traceHi[k][0] = traceHi[k-1][0]; traceHi[k][1] = traceHi[k-1][1];
+				}
+				statsTrace(frames, k, mult,
+							b0 + (int)floor(traceLo[k][0]) - 1, b1 + (int)ceil(traceHi[k][0]) + 1,
+							traceLo[k], traceHi[k]);
+			}
+			for (int k = 3; k < nNeighbours; k++) {
+				if (k > 3) {
+					traceLo[k][0] = traceLo[k-1][0]; traceLo[k][1] = traceLo[k-1][1];
+					traceHi[k][0] = traceHi[k-1][0]; traceHi[k][1] = traceHi[k-1][1];
+				}
+				statsTrace(frames, k+1, -mult,
+							b0 + (int)floor(traceLo[k][0]) - s - 1, b1 + (int)ceil(traceHi[k][0]) + s + 1,
+							traceLo[k], traceHi[k]);
+			}
+		}
+		if (frames.guide[kMaxCandidates])
+			extendTrace(tile, viewDisparity(), 1.0f, b0, b1, traceLo[kMaxCandidates-1], traceHi[kMaxCandidates-1]);
+
+		for (int k = 0; k < kMaxCandidates; k++) {
+			if (!frames.guide[k+1])
+				continue;
+			const int c0 = b0 + (int)floor(traceLo[k][0]) - s - 1;
+			const int c1 = b1 + (int)ceil(traceHi[k][0]) + s + 1;
+			if (c1 - c0 > kMaxBlockWindow) {
+				frames.usable[b * kMaxCandidates + k] = 1;
+				continue;
+			}
 
-					resultValueE[1][0] += pChannel[k][6]*currentWeight;
-					resultValueE[1][1] += pChannel[k][7]*currentWeight;
-					resultValueE[1][2] += pChannel[k][8]*currentWeight;
+			float gap[3];
+			for (int c = 0; c < 3; c++) {
+				float lo, hi;
+				statsRange(frames, k+1, c, c0, c1, lo, hi);
+				gap[c] = std::max(0.0f, std::max(lo - blockHi[c], blockLo[c] - hi));
+			}
+			const float minDist = sqrt((float)_epsX*gap[0]*gap[0] + _epsY*gap[1]*gap[1] + _epsZ*gap[2]*gap[2]);
+			frames.usable[b * kMaxCandidates + k] = !(minDist > _eps);
+		}
+	}
+}
 
-					resultValueE[2][0] += pChannel[k][9]*currentWeight;
-					resultValueE[2][1] += pChannel[k][10]*currentWeight;
-					resultValueE[2][2] += pChannel[k][11]*currentWeight;
+/*! Tests the sample (sampleX, sampleY) of candidate frame against the pixel
+	with the guides guide0 and beauty beauty0. If it passes the thresholds and
+	is closer than the best match so far, it becomes the match in point. In
+	feature mode feature0 holds the pixel's features. The distance between
+	the match features plus the sum of both residuals bounds the whitened
+	distance of the full guides from above, so a sample within a unit of it
+	passes every threshold of the full test; maxDist then holds its square.
+ */
+void GinzburgDenoiseFilterPlugin::testCandidate ( const RowFrames& frames, int frame, float sampleX, float sampleY,
+												  const float* guide0, const float* beauty0, float* point, float& maxDist, float& weight,
+												  const float* feature0 )
+{
+	Tile& g = *frames.guide[frame+1];
+	const int ty = g.clampy(sampleY);
+	const int tx = g.clampx(sampleX);
+	float guide1[8];
+
+	if (feature0) {
+		const float* feature1 = frames.features[frame+1].at(tx, ty);
+		const float residual = feature0[4] + feature1[4];
+		const float d2 = featureDist2(feature0, feature1) + residual * residual;
+		if ((d2 <= 1.0f)&&
+			(d2 < maxDist)&&
+			(sampleX < frames.sampleR)&&
+			(sampleX > 0)&&
+			(sampleY < frames.sampleT)&&
+			(sampleY > 0)&&
+			(_lic)){
+				maxDist = d2;
+				point[0] = sampleX;
+				point[1] = sampleY;
+				weight = 1;
+			}
+		return;
+	}
 
-					resultValueE[3][0] += pChannel[k][12]*currentWeight;
-					resultValueE[3][1] += pChannel[k][13]*currentWeight;
-					resultValueE[3][2] += pChannel[k][14]*currentWeight;
+	frames.packed[frame+1].load(tx, ty, guide1);
+
+	// Distance Treshold
+	const float dx = guide0[0] - guide1[0];
+	const float dy = guide0[1] - guide1[1];
+	const float dz = guide0[2] - guide1[2];
+	const float pDist = sqrt((float)_epsX*dx*dx + _epsY*dy*dy + _epsZ*dz*dz);
+
+	// color and albedo treshold
+	const float* colour1 = frames.colour[frame+1].at(tx, ty);
+	float colorDist2 = 0;
+	float albedoDist2 = 0;
+	for (int c = 0; c < 3; c++) {
+		const float db = beauty0[c] - colour1[c];
+		const float da = guide0[4 + c] - guide1[4 + c];
+		colorDist2 += db*db;
+		albedoDist2 += da*da;
+	}
+	const float pColor = sqrt(colorDist2);
+	const float pZtA = sqrt(albedoDist2);
+
+	if(	(pDist <= _eps)&&
+		(pColor <= _epsColor)&&
+		(pZtA <= _wAt)&&
+		(pDist < maxDist)&&
+		(sampleX < frames.sampleR)&&
+		(sampleX > 0)&&
+		(sampleY < frames.sampleT)&&
+		(sampleY > 0)&&
+		(_lic)){
+			maxDist = pDist;
+			point[0] = sampleX;
+			point[1] = sampleY;
+			weight = 1;
+		}
+}
+
+/*! Temporal search of the pixel (i, y) of the current frame of frames into
+	its neighbour frames. Neighbour frames the block test rejected are
+	skipped. points, maxDist and weights receive, for each of the six, the
+	best match, its distance and 1 if a match was accepted, else 0.
+
+	hint, if given, holds matches (x, y, accepted) into the six neighbour
+	frames found by the lead eye and moved by the disparity; only a
+	kRefineRadius window around them is searched then. Frames the lead eye
+	found no match in get the full search.
+	Returns false if the render was aborted.
+ */
+bool GinzburgDenoiseFilterPlugin::searchPixel ( const RowFrames& frames, int i, int y, const float* hint,
+												float (*points)[2], float* maxDist, float* weights, AbortPoll& poll )
+{
+	Tile& tile = *frames.full[0];
+	const unsigned char* usable = frames.blockUsable(i);
+	const int cy = tile.clampy(y);
+	const int cx = tile.clampx(i);
+	const int nNeighbours = _passFrames - 1;
+
+	float mvTrace[6][2];
+	float forwardTrace[3][2];
+	float guide0[8];
+	float beauty0[3];
+
+	for (int k = 0; k < kMaxCandidates - 1; k++) {
+		points[k][0] = points[k][1] = 0;
+		maxDist[k] = 1000000;
+		weights[k] = 0;
+	}
 
-					sumWeight += currentWeight;
+	// Feature mode compares the projected features instead of the guides.
+	const float* feature0 = frames.features[0].data ? frames.features[0].at(cx, cy) : 0;
+	if (!feature0)
+		frames.packed[0].load(cx, cy, guide0);
+	else
+		std::fill(guide0, guide0 + 8, 0.0f);
+	for (int c = 0; c < 3; c++)
+		beauty0[c] = tile[_beauty[c]][cy][cx];
+
+	// The lead eye already traced this point into the frames it found a match in.
+	bool fullSearch[6];
+	int nRefined = 0, nFull = 0;
+	for (int frame = 0; frame < nNeighbours; frame++) {
+		fullSearch[frame] = false;
+		if (!usable[frame])
+			continue;
+		const float* h = hint ? &hint[frame * 3] : 0;
+		if (!h || h[2] == 0) {
+			fullSearch[frame] = true;
+			nFull++;
+			continue;
+		}
+		for ( int px = -kRefineRadius; px < kRefineRadius+1; px++ )
+			for ( int py = -kRefineRadius; py < kRefineRadius+1; py++ )
+				testCandidate(frames, frame, h[0]+px, h[1]+py, guide0, beauty0,
+							  points[frame], maxDist[frame], weights[frame], feature0);
+		nRefined++;
+	}
+	if (nRefined > 0 && poll((2*kRefineRadius+1)*(2*kRefineRadius+1)*nRefined))
+		return false;
+	if (nFull == 0)
+		return true;
+
+	// The forward frames follow the motion vectors of the pixel itself, so
+	// their part of the trace does not depend on the search offset.
+	for(int j = 0; j < 3; j++)
+		forwardTrace[j][0] = forwardTrace[j][1] = 0.0f;
+	if(useMV){
+		forwardTrace[0][0] = tile[_mv[0]][cy][cx]*MotionVectorMult;
+		forwardTrace[0][1] = tile[_mv[1]][cy][cx]*MotionVectorMult;
+		for(int j = 1; j < std::min(3, nNeighbours); j++){
+			Tile& t = *frames.guide[j];
+			const int ty = t.clampy(y+forwardTrace[j-1][1]);
+			const int tx = t.clampx(i+forwardTrace[j-1][0]);
+			forwardTrace[j][0] = t[_mv[0]][ty][tx]*MotionVectorMult+forwardTrace[j-1][0];
+			forwardTrace[j][1] = t[_mv[1]][ty][tx]*MotionVectorMult+forwardTrace[j-1][1];
+		}
+	}
+
+	for ( int px = -_passSearchRadius; px < _passSearchRadius+1; px++ ) {
+		for ( int py = -_passSearchRadius; py < _passSearchRadius+1; py++ ) {
+
+			for(int j = 0; j < 6; j++)
+				for(int j1 = 0; j1 < 2; j1++)
+					mvTrace[j][j1] = 0.0f;
+
+			// MotionVector tracer
+			if(useMV){
+				for(int j = 0; j < 3; j++){
+					mvTrace[j][0] = forwardTrace[j][0];
+					mvTrace[j][1] = forwardTrace[j][1];
 				}
+				for(int j = 3; j < nNeighbours; j++){
+					Tile& t = *frames.guide[j+1];
+					const float prevX = j > 3 ? mvTrace[j-1][0] : 0.0f;
+					const float prevY = j > 3 ? mvTrace[j-1][1] : 0.0f;
+					const int ty = t.clampy(y+prevY+py);
+					const int tx = t.clampx(i+prevX+px);
+					mvTrace[j][0] = -t[_mv[0]][ty][tx]*MotionVectorMult+prevX;
+					mvTrace[j][1] = -t[_mv[1]][ty][tx]*MotionVectorMult+prevY;
+				}
+			}
+
+			for (int frame = 0; frame < nNeighbours; frame++){
+				if (!fullSearch[frame])
+					continue;
+				testCandidate(frames, frame, i+mvTrace[frame][0]+px, y+mvTrace[frame][1]+py, guide0, beauty0,
+							  points[frame], maxDist[frame], weights[frame], feature0);
+			}
+		}
+		if (poll((2*_passSearchRadius+1)*nFull))
+			return false;
+	}
+	return true;
+}
+
+/*! Runs the temporal search and the spatio-temporal kernel for the pixel (i, y)
+	of the current frame, reading the tiles fetched by fetchRow(). result
+	receives the filtered beauty followed by the three components of each of
+	the four extra channels. hint is passed on to searchPixel(); given, if
+	set, holds matches in the same layout that are used instead of a search.
+	Returns false if the render was aborted while the pixel was filtered.
+ */
+bool GinzburgDenoiseFilterPlugin::denoisePixel ( const RowFrames& frames, int i, int y, float* result, AbortPoll& poll,
+												 const float* hint, const float* given )
+{
+	Tile& tile = *frames.full[0];
+	const unsigned char* usable = frames.blockUsable(i);
+	const int cy = tile.clampy(y);
+	const int cx = tile.clampx(i);
+	const int nNeighbours = _passFrames - 1;
+	const bool otherEye = frames.full[kMaxCandidates] && usable[kMaxCandidates-1];
+	const int nCandidates = nNeighbours + (frames.guide[kMaxCandidates] ? 1 : 0);
+
+	float pColor, pZt, pZtA, pPos;
+	float temporalPointsXY[kMaxCandidates][2];
+	float maxDist[kMaxCandidates];
+	float sumWeightXY[kMaxCandidates];
+	float spatTemporalWeight = 0;
+
+	float albedoValue0[3];
+	float albedoValue1[3];
+	float beautyValue0[3];
+	float beautyValue1[3];
+	float normalValue0[3];
+	float normalValue1[3];
+	float depthValue;
+	float guide0[8];
+	float guide1[8];
+
+	float currWeightSpat = 0;
+	float beautyDist = 0;
+	float albedoDist = 0;
+	float depthDist = 0;
+	float normalDist = 0;
+	float positionDist = 0;
+
+	float resultValue[15];
+	float currentWeight = 0;
+	float sumWeight = 1;
+
+	temporalPointsXY[kMaxCandidates-1][0] = 0;
+	temporalPointsXY[kMaxCandidates-1][1] = 0;
+	sumWeightXY[kMaxCandidates-1] = 0;
+	maxDist[kMaxCandidates-1] = 1000000;
+
+	for (int c = 0; c < 3; c++) {
+		resultValue[c] = tile[_beauty[c]][cy][cx];
+		for (int e = 0; e < 4; e++)
+			resultValue[3 + e * 3 + c] = tile[_extraChannel[e][c]][cy][cx];
+
+		beautyValue0[c] = tile[_beauty[c]][cy][cx];
+	}
+
+	// Feature mode compares the projected features instead of the guides.
+	const GuideBuffer& current = frames.packed[0];
+	const float* feature0 = frames.features[0].data ? frames.features[0].at(cx, cy) : 0;
+	if (!feature0) {
+		current.load(cx, cy, guide0);
+		current.loadNormal(cx, cy, normalValue0);
+	} else {
+		std::fill(guide0, guide0 + 8, 0.0f);
+		std::fill(normalValue0, normalValue0 + 3, 0.0f);
+	}
+	for (int c = 0; c < 3; c++)
+		albedoValue0[c] = guide0[4 + c];
+	depthValue = guide0[3];
+
+	if (given) {
+		// Matches into frames this row did not fetch are dropped.
+		for (int k = 0; k < 6; k++) {
+			temporalPointsXY[k][0] = given[k * 3];
+			temporalPointsXY[k][1] = given[k * 3 + 1];
+			sumWeightXY[k] = k < nNeighbours && frames.full[k+1] ? given[k * 3 + 2] : 0;
+			maxDist[k] = 0;
+		}
+	} else if (!searchPixel(frames, i, y, hint, temporalPointsXY, maxDist, sumWeightXY, poll))
+		return false;
+
+	// The other eye of the current frame, searched around the disparity.
+	if (otherEye) {
+		const Channel* disparity = viewDisparity();
+		const float dx = tile[disparity[0]][cy][cx];
+		const float dy = tile[disparity[1]][cy][cx];
+		for ( int px = -_passSearchRadius; px < _passSearchRadius+1; px++ ) {
+			for ( int py = -_passSearchRadius; py < _passSearchRadius+1; py++ )
+				testCandidate(frames, kMaxCandidates-1, i+dx+px, y+dy+py, guide0, beautyValue0,
+							  temporalPointsXY[kMaxCandidates-1], maxDist[kMaxCandidates-1], sumWeightXY[kMaxCandidates-1],
+							  feature0);
+			if (poll(2*_passSearchRadius+1))
+				return false;
+		}
+	}
+
+	for(int k = 0; k < kMaxCandidates; k++){
+		if (nCandidates > 0)
+			spatTemporalWeight += sumWeightXY[k]/nCandidates;
+	}
+
+	// Current channel
+	for ( int px = -_passKernelRadius; px < _passKernelRadius+1; px++ ) {
+		for ( int py = -_passKernelRadius; py < _passKernelRadius+1; py++ ){
+			pPos = sqrt((float)(px*px+py*py));
+
+			// Candidates without an accepted match have a zero weight.
+			for(int k = 0; k < kMaxCandidates; k++){
+				if (sumWeightXY[k] == 0)
+					continue;
+
+				Tile& t = *frames.full[k+1];
+				const int ty = t.clampy(temporalPointsXY[k][1]+py);
+				const int tx = t.clampx(temporalPointsXY[k][0]+px);
+				const float* pChannel = frames.colour[k+1].at(tx, ty);
+
+				if (feature0) {
+					const float d2 = featureDist2(&feature0[8], &frames.features[k+1].at(tx, ty)[8]);
+					currentWeight = sumWeightXY[k]*_wT/(exp(d2*0.5)*
+									exp((pPos/_wPosition)*(pPos/_wPosition)*0.5));
+				} else {
+					frames.packed[k+1].load(tx, ty, guide1);
+
+					float colorDist2 = 0;
+					float albedoDist2 = 0;
+					for (int c = 0; c < 3; c++) {
+						const float db = beautyValue0[c] - pChannel[c];
+						const float da = albedoValue0[c] - guide1[4 + c];
+						colorDist2 += db*db;
+						albedoDist2 += da*da;
+					}
+					pZt = abs(depthValue - guide1[3]);
+					pColor = sqrt(colorDist2);
+					// The two furthest back frames compare beauty in the albedo term.
+					pZtA = k == 4 || k == 5 ? pColor : sqrt(albedoDist2);
+
+					currentWeight = sumWeightXY[k]*_wT/(exp((pZt/_wDist)*(pZt/_wDist)*0.5)*
+									exp((pColor/_wColor)*(pColor/_wColor)*0.5)*
+									exp((pZtA/_wAt)*(pZtA/_wAt)*0.5)*
+									exp((pPos/_wPosition)*(pPos/_wPosition)*0.5));
+				}
+
+				for (int c = 0; c < 15; c++)
+					resultValue[c] += pChannel[c]*currentWeight;
+
+				sumWeight += currentWeight;
+			}
+
+			const int sy = tile.clampy(y + py);
+			const int sx = tile.clampx(i + px);
+
+			for (int c = 0; c < 3; c++)
+				beautyValue1[c] = tile[_beauty[c]][sy][sx];
+
+			if (feature0) {
+				const float d2 = featureDist2(&feature0[12], &frames.features[0].at(sx, sy)[12]);
+				currWeightSpat = ( 1 - spatTemporalWeight)*_wS/(exp(d2*0.5)*
+										exp((pPos/_wPosition)*(pPos/_wP)*0.5));
+			} else {
+				current.load(sx, sy, guide1);
+				current.loadNormal(sx, sy, normalValue1);
+				for (int c = 0; c < 3; c++)
+					albedoValue1[c] = guide1[4 + c];
+
+				beautyDist = sqrt((float)(beautyValue0[0]-beautyValue1[0])*(beautyValue0[0]-beautyValue1[0])+
+							(beautyValue0[1]-beautyValue1[1])*(beautyValue0[1]-beautyValue1[1])+
+							(beautyValue0[2]-beautyValue1[2])*(beautyValue0[2]-beautyValue1[2]));
+
+				albedoDist = sqrt((float)(albedoValue0[0]-albedoValue1[0])*(albedoValue0[0]-albedoValue1[0])+
+							(albedoValue0[1]-albedoValue1[1])*(albedoValue0[1]-albedoValue1[1])+
+							(albedoValue0[2]-albedoValue1[2])*(albedoValue0[2]-albedoValue1[2]));
+
+				depthDist = abs(depthValue - guide1[3]);
+
+				normalDist = sqrt((float)(normalValue0[0]-normalValue1[0])*(normalValue0[0]-normalValue1[0])+
+							(normalValue0[1]-normalValue1[1])*(normalValue0[1]-normalValue1[1])+
+							(normalValue0[2]-normalValue1[2])*(normalValue0[2]-normalValue1[2]));
+
+				positionDist = pPos;
 
 				currWeightSpat = ( 1 - spatTemporalWeight)*_wS/(exp((normalDist/_wN)*(normalDist/_wN)*0.5)*
 										exp((beautyDist/_wColor)*(beautyDist/_wB)*0.5)*
 										exp((positionDist/_wPosition)*(positionDist/_wP)*0.5)*
 										exp((depthDist/_wD)*(depthDist/_wD)*0.5)*
 										exp((albedoDist/_wA)*(albedoDist/_wA)*0.5));
+			}
 
-				resultValue[0] += tile[_beauty[0]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
-				resultValue[1] += tile[_beauty[1]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
-				resultValue[2] += tile[_beauty[2]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
+			resultValue[0] += beautyValue1[0]*currWeightSpat;
+			resultValue[1] += beautyValue1[1]*currWeightSpat;
+			resultValue[2] += beautyValue1[2]*currWeightSpat;
+			for (int e = 0; e < 4; e++)
+				for (int c = 0; c < 3; c++)
+					resultValue[3 + e * 3 + c] += tile[_extraChannel[e][c]][sy][sx]*currWeightSpat;
 
-				resultValueE[0][0] += tile[_extraChannel[0][0]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
-				resultValueE[0][1] += tile[_extraChannel[0][1]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
-				resultValueE[0][2] += tile[_extraChannel[0][2]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
+			sumWeight += currWeightSpat;
+		}
+		if (poll((2*_passKernelRadius+1)*(nCandidates+1)))
+			return false;
+	}
 
-				resultValueE[1][0] += tile[_extraChannel[1][0]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
-				resultValueE[1][1] += tile[_extraChannel[1][1]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
-				resultValueE[1][2] += tile[_extraChannel[1][2]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
+	for (int c = 0; c < 15; c++)
+		result[c] = resultValue[c]/sumWeight;
+	return true;
+}
 
-				resultValueE[2][0] += tile[_extraChannel[2][0]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
-				resultValueE[2][1] += tile[_extraChannel[2][1]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
-				resultValueE[2][2] += tile[_extraChannel[2][2]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
+/*! Filters coarse row cy of the proxy grid into the proxy cache, over the
+	columns of the grid. Only one thread filters a row; others needing it wait until it is filled, or take
+	it over if that thread was aborted. Returns false if the render was
+	aborted before the row could be completed.
+ */
+bool GinzburgDenoiseFilterPlugin::fillProxyRow ( int cy, ChannelMask channels )
+{
+	_proxyLock.lock();
+	while (_proxyRowDone[cy] == kProxyRowFiltering)
+		_proxyLock.wait();
+	const bool filled = _proxyRowDone[cy] == kProxyRowFilled;
+	if (!filled)
+		_proxyRowDone[cy] = kProxyRowFiltering;
+	_proxyLock.unlock();
+	if (filled)
+		return true;
+
+	const int x = _proxyX;
+	const int r = std::min(_proxyX + (_proxyW - 1) * _proxyStep + 1, info_.r());
+	const int ys = std::min(_proxyY + cy * _proxyStep, info_.t() - 1);
+
+	ScratchArena& arena = ScratchArena::local();
+	ScratchArena::Scope scope(arena, _scratchBytes);
+	RowFrames frames;
+	bool done = fetchRow(ys, x, r, channels, frames, arena);
+
+	AbortPoll poll(this);
+	float* row = done ? arena.allocate<float>((size_t)_proxyW * 15) : 0;
+	for (int cx = 0; cx < _proxyW && done; cx++) {
+		const int xs = std::min(_proxyX + cx * _proxyStep, r - 1);
+		done = denoisePixel(frames, xs, ys, &row[cx * 15], poll);
+	}
 
-				resultValueE[3][0] += tile[_extraChannel[3][0]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
-				resultValueE[3][1] += tile[_extraChannel[3][1]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
-				resultValueE[3][2] += tile[_extraChannel[3][2]][tile.clampy(y+py)][tile.clampx(i+px)]*currWeightSpat;
+	GinzburgDenoiseFilterPlugin* first = static_cast<GinzburgDenoiseFilterPlugin*>(firstOp());
+	atomicMax(first->_scratchPeak, scope.peak());
 
-				sumWeight += currWeightSpat;
-			}
-				outr[i] = resultValue[0]/sumWeight;
-				outg[i] = resultValue[1]/sumWeight;
-				outb[i] = resultValue[2]/sumWeight;
+	_proxyLock.lock();
+	if (done)
+		std::copy(row, row + (size_t)_proxyW * 15, _proxyCache.begin() + (size_t)cy * _proxyW * 15);
+	_proxyRowDone[cy] = done ? kProxyRowFilled : kProxyRowEmpty;
+	_proxyLock.signal();
+	_proxyLock.unlock();
+	return done;
+}
+
+/*! Preview version of engine(). The two proxy grid rows around y are filtered
+	(or taken from the cache) and every output pixel is a joint-bilateral
+	blend of its four surrounding grid samples: the bilinear weight of each
+	sample is multiplied by the similarity of its full resolution normal,
+	depth and albedo to those of the output pixel, so edges in the guides
+	stay sharp even though the filter itself ran at low resolution.
+ */
+bool GinzburgDenoiseFilterPlugin::engineProxy ( int y, int x, int r, ChannelMask channels, Row& outRow )
+{
+	const int step = _proxyStep;
+	const int yc = std::max(info_.y(), std::min(y, info_.t() - 1));
+	const int cy0 = (yc - _proxyY) / step;
 
-				outE0r[i] = resultValueE[0][0]/sumWeight;
-				outE0g[i] = resultValueE[0][1]/sumWeight;
-				outE0b[i] = resultValueE[0][2]/sumWeight;
+	ChannelSet c1 = inputChannels(channels);
+	foreach(z, c1) outRow.writable(z);
+
+	if (!fillProxyRow(cy0, channels) || !fillProxyRow(cy0 + 1, channels)) {
+		std::cerr << "Aborted!";
+		return false;
+	}
 
-				outE1r[i] = resultValueE[1][0]/sumWeight;
-				outE1g[i] = resultValueE[1][1]/sumWeight;
-				outE1b[i] = resultValueE[1][2]/sumWeight;
+	ChannelSet guideChannels;
+	for (int c = 0; c < 3; c++) {
+		guideChannels += _normal[c];
+		guideChannels += _albedo[c];
+	}
+	guideChannels += _depth[0];
 
-				outE2r[i] = resultValueE[2][0]/sumWeight;
-				outE2g[i] = resultValueE[2][1]/sumWeight;
-				outE2b[i] = resultValueE[2][2]/sumWeight;
+	const int ys0 = _proxyY + cy0 * step;
+	Tile guide( input0(), x - step, ys0, r + step, ys0 + step + 1, guideChannels);
+	if ( aborted() ) {
+		std::cerr << "Aborted!";
+		return false;
+	}
 
-				outE3r[i] = resultValueE[3][0]/sumWeight;
-				outE3g[i] = resultValueE[3][1]/sumWeight;
-				outE3b[i] = resultValueE[3][2]/sumWeight;
+	float* out[15];
+	for (int c = 0; c < 3; c++) {
+		out[c] = outRow.writable(_beauty[c]);
+		for (int e = 0; e < 4; e++)
+			out[3 + e * 3 + c] = outRow.writable(_extraChannel[e][c]);
+	}
+
+	const int gy = guide.clampy(y);
+	for (int i = x; i < r; i++) {
+		const int ic = std::max(info_.x(), std::min(i, info_.r() - 1));
+		const int cx0 = (ic - _proxyX) / step;
+		const int gx = guide.clampx(i);
+
+		float sum[15] = {0};
+		float sumBilinear[15] = {0};
+		float weightSum = 0;
+		float bilinearSum = 0;
+
+		for (int k = 0; k < 4; k++) {
+			const int cx = cx0 + (k & 1);
+			const int cy = cy0 + (k >> 1);
+			const int xs = std::min(_proxyX + cx * step, info_.r() - 1);
+			const int ys = std::min(_proxyY + cy * step, info_.t() - 1);
+			const float bx = std::max(0.0f, 1.0f - fabs((float)(ic - xs)) / step);
+			const float by = std::max(0.0f, 1.0f - fabs((float)(yc - ys)) / step);
+			const float bilinear = bx * by;
+			if (bilinear <= 0.0f)
+				continue;
+
+			const int sx = guide.clampx(xs);
+			const int sy = guide.clampy(ys);
+			float normalDist = 0;
+			float albedoDist = 0;
+			for (int c = 0; c < 3; c++) {
+				const float dn = guide[_normal[c]][gy][gx] - guide[_normal[c]][sy][sx];
+				const float da = guide[_albedo[c]][gy][gx] - guide[_albedo[c]][sy][sx];
+				normalDist += dn * dn;
+				albedoDist += da * da;
+			}
+			const float depthDist = guide[_depth[0]][gy][gx] - guide[_depth[0]][sy][sx];
+
+			const float weight = bilinear * exp(-0.5f * (normalDist / (_wN * _wN) +
+														depthDist * depthDist / (_wD * _wD) +
+														albedoDist / (_wA * _wA)));
+
+			const float* sample = &_proxyCache[((size_t)cy * _proxyW + cx) * 15];
+			for (int c = 0; c < 15; c++) {
+				sum[c] += sample[c] * weight;
+				sumBilinear[c] += sample[c] * bilinear;
+			}
+			weightSum += weight;
+			bilinearSum += bilinear;
+		}
+
+		// Fall back to plain bilinear where no grid sample matches the guides.
+		if (weightSum > 1e-6f) {
+			for (int c = 0; c < 15; c++)
+				out[c][i] = sum[c] / weightSum;
+		} else {
+			for (int c = 0; c < 15; c++)
+				out[c][i] = sumBilinear[c] / bilinearSum;
+		}
 	}
-	
+	return true;
 }